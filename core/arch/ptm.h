@@ -6,6 +6,7 @@
 #define PTM_FLAG_EXEC (1 << 0)
 #define PTM_FLAG_WRITE (1 << 1)
 #define PTM_FLAG_READ (1 << 2)
+#define PTM_FLAG_WRITE_COMBINE (1 << 3)
 
 #define PTM_PAGE_GRANULARITY PTM_PAGE_SIZE_4K
 
@@ -17,7 +18,10 @@ typedef enum : uint64_t {
 
 #ifdef __ARCH_X86_64
 
-#define PTM_VA_BITS(ADDRESS_SPACE) ((ADDRESS_SPACE)->level_count == 4 ? 48 : 52)
+#define PTM_VA_BITS(ADDRESS_SPACE) ((ADDRESS_SPACE)->level_count == 4 ? 48 : 57)
+
+/// PAT layout mappings rely on. The reset default with PA1 and PA5 (selected by PWT) changed from write-through to write-combining
+#define PTM_X86_64_PAT ((uint64_t) 0x0007'0106'0007'0106)
 
 typedef struct {
     size_t level_count;
@@ -26,7 +30,7 @@ typedef struct {
 
 #elif __ARCH_AARCH64
 
-#define PTM_VA_BITS(ADDRESS_SPACE) ((ADDRESS_SPACE)->level_count == 4 ? 48 : 57)
+#define PTM_VA_BITS(ADDRESS_SPACE) ((ADDRESS_SPACE)->level_count == 4 ? 48 : 52)
 
 typedef struct {
     size_t level_count;
@@ -37,5 +41,11 @@ typedef struct {
 #error Unimplemented
 #endif
 
-ptm_address_space_t *arch_ptm_create_address_space();
+/// Largest level count supported by `arch_ptm_create_address_space`.
+size_t arch_ptm_max_level_count();
+
+ptm_address_space_t *arch_ptm_create_address_space(size_t level_count);
 void arch_ptm_map(ptm_address_space_t *address_space, uint64_t paddr, uint64_t vaddr, uint64_t length, uint8_t flags);
+
+/// Program the memory types mappings rely on into the current CPU. Returns false when only default caching is available.
+bool arch_ptm_load_memory_types();
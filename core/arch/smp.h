@@ -1,27 +1,65 @@
 #pragma once
 
 #include "arch/ptm.h"
+#include "dev/numa.h"
+
+#ifdef __ARCH_X86_64
+#include "arch/x86_64/cpuid.h"
+#endif
 
 #include <stdint.h>
 
 typedef struct smp_cpu {
     uint32_t acpi_id;
 #ifdef __ARCH_X86_64
-    uint8_t lapic_id;
+    uint32_t lapic_id;
 #elif __ARCH_AARCH64
     uint64_t mpidr;
 #endif
 
+    /// Proximity domain from the SRAT, `NUMA_DOMAIN_NONE` without one
+    uint32_t domain;
+
     bool is_bsp;
     bool init_failed;
 
+#ifdef __ARCH_X86_64
+    /// CPUID leaves describing the topology and caches, recorded by the CPU itself during startup. See `x86_64_topology_decode`
+    x86_64_cpuid_registers_t *cpuid_dump;
+#endif
+
+    /// Mailbox on its own cache line, the jump address followed by the argument
     uint64_t *park_address;
 
     struct smp_cpu *next;
 } smp_cpu_t;
 
 #ifdef __ARCH_X86_64
+/// Part of a page bitmap for a parked AP to fill, has to match the worker in apinit.asm
+typedef struct [[gnu::packed]] {
+    uint64_t bitmap;
+    uint64_t page_start, page_end;
+    uint64_t entries;
+    uint64_t entry_count;
+    uint8_t done;
+} smp_bitmap_job_t;
+
+#define SMP_MAILBOX_SIZE 64
+
+/// Broadcast start checked by every parked AP, has to match the park loop in apinit.asm.
+typedef struct [[gnu::packed]] {
+    uint64_t broadcast_address;
+    uint64_t broadcast_argument;
+} smp_park_control_t;
+
 extern void *g_smp_reserved_init_page;
+extern smp_park_control_t *g_smp_park_control;
+
+/// Have a parked AP fill its part of a page bitmap from a tartarus memory map.
+/// The AP runs on the kernel address space, so addresses in the job have to be HHDM addresses.
+/// The AP sets `done` and returns to its park loop when finished.
+void smp_ap_bitmap_fill(uint64_t *park_address, smp_bitmap_job_t *job, uint64_t hhdm_offset);
 #endif
 
-smp_cpu_t *smp_initialize_aps(void *rsdp, ptm_address_space_t *address_space, uint64_t stack_pgcnt, uint64_t hhdm_offset);
+/// Start the APs and park them. Stacks and mailboxes are allocated on each AP's node when `numa` is given.
+smp_cpu_t *smp_initialize_aps(void *rsdp, numa_topology_t *numa, ptm_address_space_t *address_space, uint64_t stack_pgcnt, uint64_t hhdm_offset);
@@ -50,7 +50,7 @@ void arch_disk_initialize() {
 
 bool arch_disk_read_sector(disk_t *disk, uint64_t lba, uint64_t sector_count, void *dest) {
     UINTN buffer_size = sector_count * UEFI_DISK(disk)->io->Media->BlockSize;
-    void *buffer = pmm_alloc(PMM_AREA_STANDARD, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
+    void *buffer = pmm_alloc_scratch(PMM_AREA_STANDARD, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
     EFI_STATUS status = UEFI_DISK(disk)->io->ReadBlocks(UEFI_DISK(disk)->io, UEFI_DISK(disk)->io->Media->MediaId, lba, buffer_size, buffer);
     memcpy(dest, buffer, buffer_size);
     pmm_free(buffer, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
@@ -59,7 +59,7 @@ bool arch_disk_read_sector(disk_t *disk, uint64_t lba, uint64_t sector_count, vo
 
 bool arch_disk_write_sector(disk_t *disk, uint64_t lba, uint64_t sector_count, void *src) {
     UINTN buffer_size = sector_count * UEFI_DISK(disk)->io->Media->BlockSize;
-    void *buffer = pmm_alloc(PMM_AREA_STANDARD, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
+    void *buffer = pmm_alloc_scratch(PMM_AREA_STANDARD, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
     memcpy(buffer, src, buffer_size);
     EFI_STATUS status = UEFI_DISK(disk)->io->WriteBlocks(UEFI_DISK(disk)->io, UEFI_DISK(disk)->io->Media->MediaId, lba, buffer_size, buffer);
     pmm_free(buffer, MATH_DIV_CEIL(buffer_size, PMM_GRANULARITY));
@@ -1,6 +1,7 @@
 #include "arch/cpu.h"
 #include "common/log.h"
 #include "common/panic.h"
+#include "common/timeline.h"
 #include "core.h"
 #include "memory/pmm.h"
 
@@ -17,6 +18,8 @@ static log_sink_t g_qemu_debug_sink = {.level = LOG_LEVEL_DEBUG, .char_out = qem
 #define PAGES_RESERVED_FOR_UEFI 64
 
 [[noreturn]] EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table) {
+    timeline_mark(TIMELINE_STAGE_FIRMWARE_ENTRY);
+
     g_uefi_system_table = system_table;
     g_uefi_image_handle = image_handle;
 
@@ -1,4 +1,5 @@
 global g_apinit_start
+global g_apinit_worker_bitmap
 global g_apinit_end
 
 section .rodata
@@ -48,6 +49,10 @@ bits 32
 
     mov eax, cr4
     or eax, (1 << 5)                                        ; Set PAE bit
+    cmp byte [off(boot_info.set_la57)], 0
+    je .nola57
+    or eax, (1 << 12)                                       ; Set LA57 bit
+.nola57:
     mov cr4, eax
 
     mov ecx, 0xC0000080
@@ -66,7 +71,57 @@ bits 32
 
 .long:
 bits 64
-    mov rsp, [off(boot_info.stack)]                         ; Set RSP to the 4k stack
+    mov esi, ebx                                            ; Preserve the code offset, cpuid clobbers ebx
+    cmp byte [off(boot_info.set_x2apic)], 0
+    je .xapic
+    mov ecx, 0x1B
+    rdmsr
+    or eax, (1 << 11) | (1 << 10)                           ; Enable x2APIC mode like the BSP
+    wrmsr
+    mov ecx, 0x802
+    rdmsr
+    mov ebx, eax                                            ; x2APIC ID
+    jmp short .lookup
+.xapic:
+    mov eax, 1
+    cpuid
+    shr ebx, 24                                             ; Initial APIC ID
+.lookup:
+    mov r12, qword [rsi + (boot_info.slots - g_apinit_start)]
+    mov ecx, dword [rsi + (boot_info.slot_count - g_apinit_start)]
+.find_slot:
+    test ecx, ecx
+    jz .no_slot
+    cmp dword [r12], ebx                                    ; Find the slot for our APIC ID, see ap_slot_t
+    je .found_slot
+    add r12, 32
+    dec ecx
+    jmp short .find_slot
+.no_slot:
+    cli
+    hlt
+    jmp short .no_slot
+.found_slot:
+    mov r9, rsi                                             ; cpuid clobbers ebx, keep the code offset elsewhere
+    mov rsi, qword [r12 + 24]                               ; CPUID dump of our slot
+    mov r8d, dword [r9 + (boot_info.cpuid_count - g_apinit_start)]
+.cpuid:
+    test r8d, r8d
+    jz .cpuid_done
+    mov eax, dword [rsi]
+    mov ecx, dword [rsi + 8]
+    cpuid                                                   ; Record the leaf the BSP asked for in place, see x86_64_topology_prepare
+    mov dword [rsi], eax
+    mov dword [rsi + 4], ebx
+    mov dword [rsi + 8], ecx
+    mov dword [rsi + 12], edx
+    add rsi, 16
+    dec r8d
+    jmp short .cpuid
+.cpuid_done:
+    mov ebx, r9d
+
+    mov rsp, [r12 + 16]                                     ; Set RSP to the stack of our slot
     mov rbp, rsp
 
     cmp byte [off(boot_info.set_nx)], 0
@@ -76,6 +131,40 @@ bits 64
     or eax, (1 << 11)                                       ; Set NX bit
     wrmsr
 .noxd:
+    mov eax, dword [off(boot_info.pat)]
+    mov edx, dword [off(boot_info.pat) + 4]
+    mov ecx, eax
+    or ecx, edx
+    jz .nopat
+    wbinvd                                                  ; Flush caches & TLB around the PAT change, see arch_ptm_load_memory_types
+    mov rcx, cr3
+    mov cr3, rcx
+    mov ecx, 0x277
+    wrmsr                                                   ; Load the PAT used by the page tables
+    wbinvd
+    mov rcx, cr3
+    mov cr3, rcx
+.nopat:
+    mov rax, cr0
+    and rax, ~(1 << 2)                                      ; Clear EM bit
+    or rax, (1 << 1) | (1 << 5)                             ; Set MP & NE bits
+    mov cr0, rax
+    mov rax, cr4
+    or rax, (1 << 9) | (1 << 10)                            ; Set OSFXSR & OSXMMEXCPT bits
+    mov cr4, rax
+    fninit
+    ldmxcsr [off(boot_info.mxcsr)]
+
+    mov eax, dword [off(boot_info.xcr0)]
+    mov edx, dword [off(boot_info.xcr0) + 4]
+    test eax, eax
+    jz .noxsave
+    mov rcx, cr4
+    or rcx, (1 << 18)                                       ; Set OSXSAVE bit
+    mov cr4, rcx
+    xor ecx, ecx
+    xsetbv                                                  ; Load the same XCR0 as the BSP
+.noxsave:
     mov rax, 0x30                                           ; Data64 selector
     mov ds, rax
     mov ss, rax
@@ -86,21 +175,43 @@ bits 64
     push qword 0
     push qword 0
 
-    mov rax, qword [off(boot_info.park_address)]
-    mov rdi, rax
-    add rdi, 8
+    mov r13, qword [off(boot_info.park_control)]            ; Control line shared by all parked APs, see smp_park_control_t
+    movzx r14, byte [off(boot_info.mwait)]
+    mov rax, qword [r12 + 8]                                ; Mailbox of our slot
 
-    lock inc byte [off(boot_info.init)]                     ; Increment init to 1 to signal the BSP we are done
+    lock inc byte [r12 + 4]                                 ; Increment init to 1 to signal the BSP we are done
 
+; Park loop, rax = mailbox, r13 = park control, r14 = wait with monitor/mwait
 .loop:
-    mov rcx, qword [rax]
-    test rcx, rcx
-    jnz short .handoff
+    cmp qword [rax], 0
+    jne short .handoff
+    cmp qword [r13], 0
+    jne short .broadcast
+    test r14, r14
+    jnz short .mwait
     pause
     jmp short .loop
 
+.mwait:
+    mov r15, rax
+    xor ecx, ecx
+    xor edx, edx
+    monitor                                                 ; Arm on our own mailbox line, the write starting us wakes us
+    cmp qword [rax], 0                                      ; Recheck, the write may have landed before arming
+    jne short .handoff
+    cmp qword [r13], 0
+    jne short .broadcast
+    xor eax, eax                                            ; C1
+    mov ecx, 1                                              ; Wake on interrupts even though they are masked, see tartarus_park_control_t
+    mwait
+    mov rax, r15
+    jmp short .loop
+
+.broadcast:
+    mov rax, r13                                            ; Broadcast address & argument are laid out like a mailbox
+
 .handoff:
-    mov rdi, [rdi]
+    mov rdi, [rax + 8]                                      ; Argument
 
     xor rbx, rbx
     xor rcx, rcx
@@ -117,15 +228,101 @@ bits 64
 
     jmp qword [rax]
 
+; Fills a part of a page bitmap from a memory map, see smp_bitmap_job_t.
+; Entered from the park loop with rax = mailbox, rdi = job and every other register cleared by the handoff.
+g_apinit_worker_bitmap:
+bits 64
+    mov r8, rax                                             ; Preserve the mailbox
+    mov r9, rdi                                             ; Preserve the job
+    mov rbx, [r9 + 0]                                       ; Bitmap base
+
+    mov rdi, [r9 + 8]
+    shr rdi, 3
+    add rdi, rbx
+    mov rcx, [r9 + 16]
+    sub rcx, [r9 + 8]
+    shr rcx, 3
+    xor eax, eax
+    rep stosb                                               ; Clear our part of the bitmap
+
+    mov r10, [r9 + 24]                                      ; Memory map entries
+    mov r11, [r9 + 32]                                      ; Memory map entry count
+.entry:
+    test r11, r11
+    jz .done
+    cmp qword [r10], 0                                      ; Only usable entries are set
+    jne .next
+
+    mov rdx, [r10 + 8]
+    mov rcx, rdx
+    add rcx, [r10 + 16]
+    shr rdx, 12                                             ; First page of the entry
+    shr rcx, 12                                             ; Page past the end of the entry
+    cmp rdx, [r9 + 8]
+    cmovb rdx, [r9 + 8]                                     ; Clamp to our part
+    cmp rcx, [r9 + 16]
+    cmova rcx, [r9 + 16]
+
+.head:
+    cmp rdx, rcx
+    jae .next
+    test dl, 7
+    jz .body
+    bts qword [rbx], rdx
+    inc rdx
+    jmp .head
+
+.body:
+    mov rax, rcx
+    sub rax, rdx
+    shr rax, 3                                              ; Whole bytes left in the entry
+    jz .tail
+    mov rdi, rdx
+    shr rdi, 3
+    add rdi, rbx
+    lea rdx, [rdx + rax * 8]
+    push rcx
+    mov rcx, rax
+    mov al, 0xFF
+    rep stosb
+    pop rcx
+
+.tail:
+    cmp rdx, rcx
+    jae .next
+    bts qword [rbx], rdx
+    inc rdx
+    jmp .tail
+
+.next:
+    add r10, 24
+    dec r11
+    jmp .entry
+
+.done:
+    mov qword [r8], 0                                       ; Clear the mailbox before reporting back
+    lock inc byte [r9 + 40]                                 ; Signal the BSP we are done
+
+    mov r13, qword [rel boot_info.park_control]             ; Reload the park loop registers cleared by the handoff,
+    movzx r14, byte [rel boot_info.mwait]                   ; RIP relative as the boot info follows the code in the copied page
+    mov rax, r8
+    jmp g_apinit_start.loop
+
 g_apinit_end:
 
 boot_info:
-    .init: db 0
-    .lapic_id: db 0
     .pml4: dd 0
-    .park_address: dq 0
-    .stack: dq 0
+    .slots: dq 0
+    .slot_count: dd 0
     .gdtr:
         dw 0
         dd 0
     .set_nx: db 0
+    .set_la57: db 0
+    .pat: dq 0
+    .set_x2apic: db 0
+    .park_control: dq 0
+    .mwait: db 0
+    .cpuid_count: dd 0
+    .xcr0: dq 0
+    .mxcsr: dd 0
@@ -32,7 +32,7 @@ typedef struct [[gnu::packed]] {
 } ext_read_drive_params_t;
 
 static uint16_t estimate_sector_size(uint8_t disk_id, uint8_t test_val) {
-    uint8_t *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, 3);
+    uint8_t *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, 3);
     memset(buf, test_val, PMM_GRANULARITY * 3);
 
     disk_address_packet_t dap = {.size = sizeof(disk_address_packet_t), .sector_count = 1, .memory_segment = INT_16BIT_SEGMENT(buf), .memory_offset = INT_16BIT_OFFSET(buf), .disk_lba = 0};
@@ -50,7 +50,7 @@ static uint16_t estimate_sector_size(uint8_t disk_id, uint8_t test_val) {
 }
 
 static uint16_t estimate_optimal_transfer_size(disk_t *disk) {
-    uint8_t *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, 32);
+    uint8_t *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, 32);
     memset(buf, 0, PMM_GRANULARITY * 32);
 
     static const size_t transfer_sizes[] = {1, 2, 4, 8, 16, 24, 32, 48, 64};
@@ -104,7 +104,7 @@ void arch_disk_initialize() {
         disk->optimal_transfer_size = 1;
 
         int buf_size = MATH_DIV_CEIL(disk->sector_size, PMM_GRANULARITY);
-        void *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, buf_size);
+        void *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, buf_size);
         if(buf_size == 0 || arch_disk_read_sector(disk, 0, buf_size, buf)) {
             heap_free(disk);
             continue;
@@ -124,7 +124,7 @@ bool arch_disk_read_sector(disk_t *disk, uint64_t lba, uint64_t sector_count, vo
     disk_address_packet_t dap = {.size = sizeof(disk_address_packet_t)};
     int_regs_t regs = {.edx = disk->id, .ds = INT_16BIT_SEGMENT(&dap), .esi = INT_16BIT_OFFSET(&dap)};
     size_t buf_size = MATH_DIV_CEIL(disk->optimal_transfer_size * disk->sector_size, PMM_GRANULARITY);
-    void *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, buf_size);
+    void *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, buf_size);
     for(uint64_t i = 0; i < sector_count; i += disk->optimal_transfer_size) {
         dap.disk_lba = lba;
         uint64_t tmp_sec_count = sector_count - i;
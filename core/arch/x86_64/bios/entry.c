@@ -1,5 +1,6 @@
 #include "arch/cpu.h"
 #include "common/log.h"
+#include "common/timeline.h"
 #include "core.h"
 #include "memory/pmm.h"
 
@@ -35,6 +36,8 @@ static log_sink_t g_qemu_debug_sink = {.level = LOG_LEVEL_DEBUG, .char_out = qem
 #endif
 
 [[noreturn]] void x86_64_bios_entry() {
+    timeline_mark(TIMELINE_STAGE_FIRMWARE_ENTRY);
+
 #ifdef __BUILD_DEBUG
     qemu_debug_log('\n');
     log_sink_add(&g_qemu_debug_sink);
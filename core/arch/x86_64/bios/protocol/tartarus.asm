@@ -1,4 +1,5 @@
 global x86_64_protocol_tartarus_handoff
+global x86_64_protocol_tartarus_handoff_end
 
 bits 32
 x86_64_protocol_tartarus_handoff:
@@ -20,13 +21,16 @@ x86_64_protocol_tartarus_handoff:
     mov eax, dword [esp + 32]
     mov dword [boot_info + 4], eax
 
-    mov eax, dword [esp + 36]
+    movzx eax, word [esp + 36]
     mov dword [version], eax
-    mov eax, dword [esp + 40]
-    mov dword [version + 4], eax
 
     mov eax, cr4
     or eax, 1 << 5                              ; Enable PAE bit
+    mov edx, dword [esp + 40]
+    or edx, dword [esp + 44]
+    jz .no_la57
+    or eax, 1 << 12                             ; Enable LA57 bit
+.no_la57:
     mov cr4, eax
 
     mov ecx, 0xC0000080
@@ -80,6 +84,7 @@ entry_long:
 
 boot_info: dq 0
 version: dq 0
-top_page_table: dw 0
+top_page_table: dd 0
 stack: dq 0
 kernel_entry: dq 0
+x86_64_protocol_tartarus_handoff_end:
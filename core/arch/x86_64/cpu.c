@@ -4,10 +4,32 @@
 
 #include "arch/x86_64/cpuid.h"
 #include "arch/x86_64/msr.h"
+#include "arch/x86_64/topology.h"
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_NE (1 << 5)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+#define XCR0_AVX512 ((1 << 5) | (1 << 6) | (1 << 7))
+
+#define FXSAVE_SIZE 512
 
 bool g_x86_64_cpu_nx_support = false;
 bool g_x86_64_cpu_pdpe1gb_support = false;
 bool g_x86_64_cpu_lapic_support = false;
+bool g_x86_64_cpu_pat_support = false;
+bool g_x86_64_cpu_la57_support = false;
+bool g_x86_64_cpu_x2apic_support = false;
+bool g_x86_64_cpu_mwait_support = false;
+bool g_x86_64_cpu_xsave_support = false;
+uint64_t g_x86_64_cpu_xcr0 = 0;
 
 void arch_cpu_init() {
     x86_64_cpuid_registers_t regs;
@@ -18,6 +40,37 @@ void arch_cpu_init() {
 
     regs = x86_64_cpuid(1);
     g_x86_64_cpu_lapic_support = (regs.edx & (1 << 9)) != 0;
+    g_x86_64_cpu_pat_support = (regs.edx & (1 << 16)) != 0;
+    g_x86_64_cpu_x2apic_support = (regs.ecx & (1 << 21)) != 0;
+    g_x86_64_cpu_mwait_support = (regs.ecx & (1 << 3)) != 0;
+    g_x86_64_cpu_xsave_support = (regs.ecx & (1 << 26)) != 0;
+    bool avx_support = (regs.ecx & (1 << 28)) != 0;
+
+    bool avx512_support = false;
+    if(x86_64_cpuid(0).eax >= 7) {
+        regs = x86_64_cpuid(7);
+        g_x86_64_cpu_la57_support = (regs.ecx & (1 << 16)) != 0;
+        avx512_support = (regs.ebx & (1 << 16)) != 0;
+    }
+
+    // Parked APs only watch their own mailbox, an IPI releases them from a broadcast while interrupts are disabled.
+    // That needs the MWAIT extensions and interrupts as break events
+    if(g_x86_64_cpu_mwait_support) g_x86_64_cpu_mwait_support = x86_64_cpuid(0).eax >= 5 && (x86_64_cpuid(5).ecx & 0b11) == 0b11;
+
+    // Every CPU gets the same XCR0, limited to the state components the CPU can save
+    if(g_x86_64_cpu_xsave_support) {
+        regs = x86_64_cpuid(0xD);
+        uint64_t supported = regs.eax | ((uint64_t) regs.edx << 32);
+
+        uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+        if(avx_support && (supported & XCR0_AVX) != 0) {
+            xcr0 |= XCR0_AVX;
+            if(avx512_support && (supported & XCR0_AVX512) == XCR0_AVX512) xcr0 |= XCR0_AVX512;
+        }
+        g_x86_64_cpu_xcr0 = xcr0;
+    }
+
+    x86_64_topology_init();
 
     if(g_x86_64_cpu_nx_support) {
         x86_64_msr_write(X86_64_MSR_EFER, x86_64_msr_read(X86_64_MSR_EFER) | (1 << 11));
@@ -25,6 +78,27 @@ void arch_cpu_init() {
         log(LOG_LEVEL_WARN, "no support for EFER.NXE");
     }
     if(!g_x86_64_cpu_pdpe1gb_support) log(LOG_LEVEL_WARN, "no support for 1gb mappings");
+    if(!g_x86_64_cpu_pat_support) log(LOG_LEVEL_WARN, "no support for PAT");
+}
+
+size_t x86_64_cpu_enable_vector_state() {
+    uintptr_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+    uintptr_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if(g_x86_64_cpu_xcr0 != 0) cr4 |= CR4_OSXSAVE;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    uint32_t mxcsr = X86_64_MXCSR_DEFAULT;
+    asm volatile("fninit\n\tldmxcsr %0" : : "m"(mxcsr));
+
+    if(g_x86_64_cpu_xcr0 == 0) return FXSAVE_SIZE;
+    asm volatile("xsetbv" : : "a"((uint32_t) g_x86_64_cpu_xcr0), "d"((uint32_t) (g_x86_64_cpu_xcr0 >> 32)), "c"(0));
+    return x86_64_cpuid(0xD).ebx;
 }
 
 void arch_cpu_halt() {
@@ -1,5 +1,23 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+/// All SIMD exceptions masked, round to nearest
+#define X86_64_MXCSR_DEFAULT 0x1F80
+
 extern bool g_x86_64_cpu_nx_support;
 extern bool g_x86_64_cpu_lapic_support;
 extern bool g_x86_64_cpu_pdpe1gb_support;
+extern bool g_x86_64_cpu_pat_support;
+extern bool g_x86_64_cpu_la57_support;
+extern bool g_x86_64_cpu_x2apic_support;
+extern bool g_x86_64_cpu_mwait_support;
+extern bool g_x86_64_cpu_xsave_support;
+
+/// XCR0 loaded on every CPU, zero without XSAVE
+extern uint64_t g_x86_64_cpu_xcr0;
+
+/// Enable x87/SSE and the XSAVE components in `g_x86_64_cpu_xcr0` on the current CPU.
+/// Returns the size of the save area for the enabled state. APs do the same in apinit.asm.
+size_t x86_64_cpu_enable_vector_state();
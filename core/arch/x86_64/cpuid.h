@@ -9,8 +9,12 @@ typedef struct {
     uint32_t edx;
 } x86_64_cpuid_registers_t;
 
-static inline x86_64_cpuid_registers_t x86_64_cpuid(uint32_t leaf) {
+static inline x86_64_cpuid_registers_t x86_64_cpuid_subleaf(uint32_t leaf, uint32_t subleaf) {
     x86_64_cpuid_registers_t registers;
-    asm volatile("cpuid" : "=a"(registers.eax), "=b"(registers.ebx), "=c"(registers.ecx), "=d"(registers.edx) : "a"(leaf), "c"(0));
+    asm volatile("cpuid" : "=a"(registers.eax), "=b"(registers.ebx), "=c"(registers.ecx), "=d"(registers.edx) : "a"(leaf), "c"(subleaf));
     return registers;
 }
+
+static inline x86_64_cpuid_registers_t x86_64_cpuid(uint32_t leaf) {
+    return x86_64_cpuid_subleaf(leaf, 0);
+}
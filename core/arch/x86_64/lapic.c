@@ -7,11 +7,16 @@
 
 #define MSR_LAPIC_BASE 0x1B
 #define MSR_LAPIC_BASE_MASK 0xFFFFF000
+#define MSR_LAPIC_BASE_X2APIC (1 << 10)
+#define MSR_LAPIC_BASE_ENABLE (1 << 11)
+
+#define MSR_X2APIC(REG) (0x800 + ((REG) >> 4))
 
 #define REG_ID 0x20
 #define REG_ICR1 0x300
 #define REG_ICR2 0x310
 
+#define ICR_PENDING 0x1000
 #define ICR_ASSERT 0x4000
 #define ICR_INIT 0x500
 #define ICR_STARTUP 0x600
@@ -24,19 +29,44 @@ static inline uint32_t lapic_read(uint32_t reg) {
     return *(volatile uint32_t *) (uintptr_t) ((x86_64_msr_read(MSR_LAPIC_BASE) & MSR_LAPIC_BASE_MASK) + reg);
 }
 
+/// Wait for the previous IPI to be accepted, the ICR must not be rewritten while it is pending.
+static void ipi_wait() {
+    while((lapic_read(REG_ICR1) & ICR_PENDING) != 0) __builtin_ia32_pause();
+}
+
+/// Send an IPI, in x2APIC mode the ICR is a single MSR with a 32-bit destination and no pending state.
+static void ipi_send(uint32_t lapic_id, uint32_t command) {
+    if(x86_64_lapic_is_x2apic()) {
+        x86_64_msr_write(MSR_X2APIC(REG_ICR1), ((uint64_t) lapic_id << 32) | command);
+        return;
+    }
+
+    if(lapic_id > 0xFF) panic("lapic id %u not addressable in xAPIC mode", lapic_id);
+    ipi_wait();
+    lapic_write(REG_ICR2, lapic_id << 24);
+    lapic_write(REG_ICR1, command);
+}
+
 uint32_t x86_64_lapic_id() {
+    if(x86_64_lapic_is_x2apic()) return (uint32_t) x86_64_msr_read(MSR_X2APIC(REG_ID));
     return (uint8_t) (lapic_read(REG_ID) >> 24);
 }
 
-void x86_64_lapic_ipi_init(uint8_t lapic_id) {
-    lapic_write(REG_ICR2, (uint32_t) lapic_id << 24);
-    lapic_write(REG_ICR1, ICR_ASSERT | ICR_INIT);
+bool x86_64_lapic_is_x2apic() {
+    return (x86_64_msr_read(MSR_LAPIC_BASE) & MSR_LAPIC_BASE_X2APIC) != 0;
+}
+
+void x86_64_lapic_enable_x2apic() {
+    x86_64_msr_write(MSR_LAPIC_BASE, x86_64_msr_read(MSR_LAPIC_BASE) | MSR_LAPIC_BASE_ENABLE | MSR_LAPIC_BASE_X2APIC);
+}
+
+void x86_64_lapic_ipi_init(uint32_t lapic_id) {
+    ipi_send(lapic_id, ICR_ASSERT | ICR_INIT);
 }
 
-void x86_64_lapic_ipi_startup(uint8_t lapic_id, void *startup_page) {
+void x86_64_lapic_ipi_startup(uint32_t lapic_id, void *startup_page) {
     size_t startup_id = (uintptr_t) startup_page / 0x1000;
     if(startup_id > 0xFF) panic("startup page exceeds 0xFF000");
 
-    lapic_write(REG_ICR2, (uint32_t) lapic_id << 24);
-    lapic_write(REG_ICR1, ICR_ASSERT | ICR_STARTUP | startup_id);
+    ipi_send(lapic_id, ICR_ASSERT | ICR_STARTUP | startup_id);
 }
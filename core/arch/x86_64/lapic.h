@@ -3,5 +3,12 @@
 #include <stdint.h>
 
 uint32_t x86_64_lapic_id();
-void x86_64_lapic_ipi_init(uint8_t lapic_id);
-void x86_64_lapic_ipi_startup(uint8_t lapic_id, void *startup_page);
\ No newline at end of file
+
+/// Whether the local APIC is in x2APIC mode, either set by firmware or through `x86_64_lapic_enable_x2apic`.
+bool x86_64_lapic_is_x2apic();
+
+/// Switch the local APIC into x2APIC mode, required to address APIC IDs above 254.
+void x86_64_lapic_enable_x2apic();
+
+void x86_64_lapic_ipi_init(uint32_t lapic_id);
+void x86_64_lapic_ipi_startup(uint32_t lapic_id, void *startup_page);
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 
+#define X86_64_MSR_PAT 0x277
 #define X86_64_MSR_EFER 0xC0000080
 
 static inline uint64_t x86_64_msr_read(uint64_t msr) {
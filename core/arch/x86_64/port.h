@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+static inline uint32_t x86_64_port_inl(uint16_t port) {
+    uint32_t value;
+    asm volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
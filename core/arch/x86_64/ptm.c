@@ -7,12 +7,14 @@
 #include "memory/pmm.h"
 
 #include "arch/x86_64/cpu.h"
+#include "arch/x86_64/msr.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
 #define ENTRY_FLAG_PRESENT (1 << 0)
 #define ENTRY_FLAG_RW (1 << 1)
+#define ENTRY_FLAG_PWT (1 << 3)
 #define ENTRY_FLAG_NX ((uint64_t) 1 << 63)
 
 #define ENTRYH_FLAG_PS (1 << 7)
@@ -23,56 +25,114 @@
 
 #define VADDR_TO_INDEX(VADDR, LEVEL) (((VADDR) >> ((LEVEL) * 9 + 3)) & 0x1FF)
 
-static void map_page(ptm_address_space_t *as, uint64_t vaddr, uint64_t paddr, ptm_page_size_t page_size, bool rw, bool nx) {
-    int lowest_level;
-    switch(page_size) {
-        case PTM_PAGE_SIZE_4K: lowest_level = 1; break;
-        case PTM_PAGE_SIZE_2M: lowest_level = 2; break;
-        case PTM_PAGE_SIZE_1G: lowest_level = 3; break;
+#define LEVEL_SIZE(LEVEL) ((uint64_t) 1 << ((LEVEL) * 9 + 3))
+
+#define TABLE_ARENA_MIN_PAGES 16
+
+static struct {
+    uintptr_t base;
+    size_t page_count;
+    size_t used;
+} g_table_arena = {};
+
+/// Make sure the table arena can hand out `count` more tables without allocating.
+static void table_reserve(size_t count) {
+    if(g_table_arena.page_count - g_table_arena.used >= count) return;
+
+    if(g_table_arena.used < g_table_arena.page_count) pmm_free((void *) (g_table_arena.base + g_table_arena.used * PMM_GRANULARITY), g_table_arena.page_count - g_table_arena.used);
+
+    if(count < TABLE_ARENA_MIN_PAGES) count = TABLE_ARENA_MIN_PAGES;
+    g_table_arena.base = (uintptr_t) pmm_alloc_persistent(count);
+    g_table_arena.page_count = count;
+    g_table_arena.used = 0;
+}
+
+static uint64_t *table_take() {
+    if(g_table_arena.used == g_table_arena.page_count) table_reserve(1);
+
+    uint64_t *table = (uint64_t *) (g_table_arena.base + g_table_arena.used++ * PMM_GRANULARITY);
+    memset(table, 0, PMM_GRANULARITY);
+    return table;
+}
+
+static bool leaf_supported(int level) {
+    switch(level) {
+        case 1: return true;
+        case 2: return true;
+        case 3: return g_x86_64_cpu_pdpe1gb_support;
     }
+    return false;
+}
 
-    uint64_t *current_table = as->top_page_table;
-    for(int level = as->level_count; level > lowest_level; level--) {
+/// Upper bound of the tables needed below the top level to map a range.
+static size_t table_estimate(ptm_address_space_t *as, uint64_t paddr, uint64_t vaddr, uint64_t length) {
+    int leaf_level = 1;
+    while(leaf_supported(leaf_level + 1) && (paddr - vaddr) % LEVEL_SIZE(leaf_level + 1) == 0) leaf_level++;
+
+    size_t count = 0;
+    for(int level = 1; level < (int) as->level_count; level++) {
+        // Below the largest usable leaf tables are only needed for the unaligned head and tail
+        if(level < leaf_level) {
+            count += 2;
+            continue;
+        }
+        count += length / LEVEL_SIZE(level + 1) + 2;
+    }
+    return count;
+}
+
+/// Map a range into `table`, descending once per table and filling consecutive entries in one go.
+static void map_range(uint64_t *table, int level, uint64_t vaddr, uint64_t paddr, uint64_t length, bool rw, bool nx, bool wc) {
+    uint64_t level_size = LEVEL_SIZE(level);
+    while(length > 0) {
         int index = VADDR_TO_INDEX(vaddr, level);
 
-        uint64_t entry = current_table[index];
-        if((entry & ENTRY_FLAG_PRESENT) == 0) {
-            uint64_t *new_table = pmm_alloc(PMM_AREA_STANDARD, 1);
-            memset(new_table, 0, PMM_GRANULARITY);
-            entry = ENTRY_FLAG_PRESENT | ((uint64_t) (uintptr_t) new_table & ENTRY_4K_ADDRESS_MASK);
+        uint64_t span = level_size - (vaddr % level_size);
+        if(span > length) span = length;
+
+        if(leaf_supported(level) && span == level_size && paddr % level_size == 0) {
+            uint64_t entry = ENTRY_FLAG_PRESENT | (paddr & (level == 1 ? ENTRY_4K_ADDRESS_MASK : (level == 2 ? ENTRY_2M_ADDRESS_MASK : ENTRY_1G_ADDRESS_MASK)));
+            if(level != 1) entry |= ENTRYH_FLAG_PS;
+            if(rw) entry |= ENTRY_FLAG_RW;
             if(nx) entry |= ENTRY_FLAG_NX;
+            if(wc) entry |= ENTRY_FLAG_PWT; // PA1/PA5 are write-combining in PTM_X86_64_PAT
+            table[index] = entry;
         } else {
-            if((entry & ENTRYH_FLAG_PS) != 0) panic("cannot remap over a non-4k page %#llx", entry & ENTRY_4K_ADDRESS_MASK);
-            if(!nx) entry &= ~ENTRY_FLAG_NX;
-        }
-        if(rw) entry |= ENTRY_FLAG_RW;
+            if(level == 1) panic("unaligned leaf mapping (%#llx -> %#llx)", paddr, vaddr);
 
-        if(current_table[index] != entry) current_table[index] = entry;
+            uint64_t entry = table[index];
+            if((entry & ENTRY_FLAG_PRESENT) == 0) {
+                entry = ENTRY_FLAG_PRESENT | ((uint64_t) (uintptr_t) table_take() & ENTRY_4K_ADDRESS_MASK);
+                if(nx) entry |= ENTRY_FLAG_NX;
+            } else {
+                if((entry & ENTRYH_FLAG_PS) != 0) panic("cannot remap over a non-4k page %#llx", entry & ENTRY_4K_ADDRESS_MASK);
+                if(!nx) entry &= ~ENTRY_FLAG_NX;
+            }
+            if(rw) entry |= ENTRY_FLAG_RW;
 
-        current_table = (uint64_t *) (entry & ENTRY_4K_ADDRESS_MASK);
-    }
+            if(table[index] != entry) table[index] = entry;
 
-    int index = VADDR_TO_INDEX(vaddr, lowest_level);
+            map_range((uint64_t *) (uintptr_t) (entry & ENTRY_4K_ADDRESS_MASK), level - 1, vaddr, paddr, span, rw, nx, wc);
+        }
 
-    uint64_t address_mask;
-    switch(page_size) {
-        case PTM_PAGE_SIZE_4K: address_mask = ENTRY_4K_ADDRESS_MASK; break;
-        case PTM_PAGE_SIZE_2M: address_mask = ENTRY_2M_ADDRESS_MASK; break;
-        case PTM_PAGE_SIZE_1G: address_mask = ENTRY_1G_ADDRESS_MASK; break;
+        vaddr += span;
+        paddr += span;
+        length -= span;
     }
+}
 
-    uint64_t entry = ENTRY_FLAG_PRESENT | (paddr & address_mask);
-    if(page_size != PTM_PAGE_SIZE_4K) entry |= ENTRYH_FLAG_PS;
-    if(rw) entry |= ENTRY_FLAG_RW;
-    if(nx) entry |= ENTRY_FLAG_NX;
-    current_table[index] = entry;
+size_t arch_ptm_max_level_count() {
+    return g_x86_64_cpu_la57_support ? 5 : 4;
 }
 
-ptm_address_space_t *arch_ptm_create_address_space() {
-    ptm_address_space_t *as = heap_alloc(sizeof(ptm_address_space_t));
-    as->level_count = 4;
+ptm_address_space_t *arch_ptm_create_address_space(size_t level_count) {
+    if(level_count < 4 || level_count > arch_ptm_max_level_count()) panic("unsupported paging level count %zu", level_count);
+
+    ptm_address_space_t *as = heap_alloc_persistent(sizeof(ptm_address_space_t));
+    as->level_count = level_count;
 
-    void *top_pagemap = pmm_alloc(PMM_AREA_STANDARD, 1);
+    // CR3 is loaded from 32-bit code by the AP init and the LA57 switch, keep the top table below 4G
+    void *top_pagemap = pmm_alloc_ext((pmm_map_area_t) {.start = PMM_AREA_STANDARD.start, .end = 0x1'0000'0000}, 1, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED);
     memset(top_pagemap, 0, PMM_GRANULARITY);
     as->top_page_table = top_pagemap;
 
@@ -83,16 +143,35 @@ void arch_ptm_map(ptm_address_space_t *as, uint64_t paddr, uint64_t vaddr, uint6
     if(paddr % PTM_PAGE_GRANULARITY != 0 || vaddr % PTM_PAGE_GRANULARITY != 0 || length % PTM_PAGE_GRANULARITY != 0) panic("unaligned mapping (%#llx -> %#llx / %#llx)", paddr, vaddr, length);
     if((flags & PTM_FLAG_READ) == 0) log(LOG_LEVEL_WARN, "mapping with no read permission");
     if(!g_x86_64_cpu_nx_support && (flags & PTM_FLAG_EXEC) == 0) log(LOG_LEVEL_WARN, "no-execute permissions not supported");
+    if(!g_x86_64_cpu_pat_support && (flags & PTM_FLAG_WRITE_COMBINE) != 0) log(LOG_LEVEL_WARN, "write-combining not supported");
+
+    table_reserve(table_estimate(as, paddr, vaddr, length));
+    map_range(
+        as->top_page_table,
+        as->level_count,
+        vaddr,
+        paddr,
+        length,
+        (flags & PTM_FLAG_WRITE) != 0,
+        g_x86_64_cpu_nx_support && (flags & PTM_FLAG_EXEC) == 0,
+        g_x86_64_cpu_pat_support && (flags & PTM_FLAG_WRITE_COMBINE) != 0
+    );
+}
 
-    uint64_t offset = 0;
-    while(offset < length) {
-        ptm_page_size_t page_size = PTM_PAGE_SIZE_4K;
-        if(paddr % PTM_PAGE_SIZE_2M == 0 && vaddr % PTM_PAGE_SIZE_2M == 0 && length - offset >= PTM_PAGE_SIZE_2M) page_size = PTM_PAGE_SIZE_2M;
-        if(g_x86_64_cpu_pdpe1gb_support && paddr % PTM_PAGE_SIZE_1G == 0 && vaddr % PTM_PAGE_SIZE_1G == 0 && length - offset >= PTM_PAGE_SIZE_1G) page_size = PTM_PAGE_SIZE_1G;
+/// Write back and invalidate the caches and flush the TLB, required around PAT changes while paging is enabled.
+static void flush_memory_types() {
+    uintptr_t cr3;
+    asm volatile("wbinvd" : : : "memory");
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
 
-        map_page(as, vaddr, paddr, page_size, (flags & PTM_FLAG_WRITE) != 0, g_x86_64_cpu_nx_support && (flags & PTM_FLAG_EXEC) == 0);
-        paddr += page_size;
-        vaddr += page_size;
-        offset += page_size;
-    }
+bool arch_ptm_load_memory_types() {
+    if(!g_x86_64_cpu_pat_support) return false;
+
+    // Live mappings using PWT change memory type, no cache line or TLB entry may keep the old one
+    flush_memory_types();
+    x86_64_msr_write(X86_64_MSR_PAT, PTM_X86_64_PAT);
+    flush_memory_types();
+    return true;
 }
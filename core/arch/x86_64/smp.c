@@ -3,6 +3,7 @@
 #include "common/log.h"
 #include "common/panic.h"
 #include "dev/acpi/tables/madt.h"
+#include "lib/math.h"
 #include "lib/mem.h"
 #include "memory/heap.h"
 #include "memory/pmm.h"
@@ -11,48 +12,88 @@
 #include "arch/x86_64/cpuid.h"
 #include "arch/x86_64/gdt.h"
 #include "arch/x86_64/lapic.h"
+#include "arch/x86_64/topology.h"
 #include "arch/x86_64/tsc.h"
 
 #include <stdint.h>
 
-#define CYCLES_10MIL 10000000
+#define INIT_DELAY_US 10'000
+#define SIPI_DELAY_US 200
+#define STARTUP_TIMEOUT_US 1'000'000
 
 // has to match boot_info in apinit.asm
 typedef struct [[gnu::packed]] {
-    uint8_t init;
-    uint8_t lapic_id;
     uint32_t pml4;
-    uint64_t park_address;
-    uint64_t stack;
+    uint64_t slots;
+    uint32_t slot_count;
     uint16_t gdtr_limit;
     uint32_t gdtr_base;
     uint8_t set_nx;
+    uint8_t set_la57;
+    uint64_t pat;
+    uint8_t set_x2apic;
+    uint64_t park_control;
+    uint8_t mwait;
+    uint32_t cpuid_count;
+    uint64_t xcr0;
+    uint32_t mxcsr;
 } ap_info_t;
 
+/// Per-AP startup state, found by the AP through its APIC ID. Has to match the slot lookup in apinit.asm
+typedef struct [[gnu::packed]] {
+    uint32_t lapic_id;
+    uint8_t init;
+    uint8_t rsv0[3];
+    uint64_t park_address;
+    uint64_t stack;
+    uint64_t cpuid_dump;
+} ap_slot_t;
+
+static_assert(sizeof(ap_slot_t) == 32);
+
 extern nullptr_t g_apinit_start[];
+extern nullptr_t g_apinit_worker_bitmap[];
 extern nullptr_t g_apinit_end[];
 
 void *g_smp_reserved_init_page;
+smp_park_control_t *g_smp_park_control;
+
+static bool slot_ready(ap_slot_t *slot) {
+    return ((volatile ap_slot_t *) slot)->init != 0;
+}
+
+static void cpu_add(smp_cpu_t **cpus, uint32_t acpi_id, uint32_t lapic_id) {
+    // Firmware may describe a processor with both a LAPIC and an x2APIC record
+    for(smp_cpu_t *cpu = *cpus; cpu != NULL; cpu = cpu->next) {
+        if(cpu->lapic_id == lapic_id) return;
+    }
+
+    smp_cpu_t *cpu = heap_alloc(sizeof(smp_cpu_t));
+    cpu->next = *cpus;
+    *cpus = cpu;
+
+    cpu->init_failed = false;
+    cpu->acpi_id = acpi_id;
+    cpu->lapic_id = lapic_id;
+    cpu->domain = NUMA_DOMAIN_NONE;
+    cpu->park_address = NULL;
+    cpu->is_bsp = false;
+
+    // A late AP still writes its dump, keep it out of memory handed to the kernel
+    cpu->cpuid_dump = heap_alloc_persistent(sizeof(x86_64_cpuid_registers_t) * x86_64_topology_leaf_count());
+    x86_64_topology_prepare(cpu->cpuid_dump);
+}
 
-smp_cpu_t *smp_initialize_aps(void *rsdp, ptm_address_space_t *address_space, uint64_t stack_pgcnt, uint64_t hhdm_offset) {
+smp_cpu_t *smp_initialize_aps(void *rsdp, numa_topology_t *numa, ptm_address_space_t *address_space, uint64_t stack_pgcnt, uint64_t hhdm_offset) {
     madt_t *madt = (madt_t *) acpi_find_table(rsdp, "APIC");
     if(madt == NULL) panic("ACPI MADT table not present");
 
-    uint8_t bsp_id = x86_64_cpuid(1).ebx >> 24;
-    log(LOG_LEVEL_INFO, "BSP ID: %u", bsp_id);
-    if(bsp_id != x86_64_lapic_id()) panic("Current lapic id does not match BSP id");
-
     size_t apinit_size = (uintptr_t) g_apinit_end - (uintptr_t) g_apinit_start;
     if(apinit_size + sizeof(ap_info_t) > PMM_GRANULARITY) panic("Unable to fit AP initialization code into a page");
     memcpy(g_smp_reserved_init_page, (void *) g_apinit_start, apinit_size);
 
-    ap_info_t *ap_info = (ap_info_t *) (g_smp_reserved_init_page + apinit_size);
-    ap_info->pml4 = (uintptr_t) address_space->top_page_table;
-    ap_info->gdtr_limit = g_x86_64_gdt_limit;
-    ap_info->gdtr_base = (uintptr_t) g_x86_64_gdt;
-    ap_info->set_nx = g_x86_64_cpu_nx_support;
-
     smp_cpu_t *cpus = NULL;
+    uint32_t max_lapic_id = 0;
     for(size_t count = sizeof(madt_t); count < madt->sdt_header.length; count += ((madt_record_t *) ((uintptr_t) madt + count))->length) {
         madt_record_t *record = (madt_record_t *) ((uintptr_t) madt + count);
         switch(record->type) {
@@ -63,53 +104,163 @@ smp_cpu_t *smp_initialize_aps(void *rsdp, ptm_address_space_t *address_space, ui
                 }
 
                 madt_record_lapic_t *lapic_record = (madt_record_lapic_t *) record;
+                if((lapic_record->flags & MADT_LAPIC_FLAG_ENABLED) == 0) continue;
 
-                log(LOG_LEVEL_INFO, "Initializing cpu [lapic id %u]", lapic_record->lapic_id);
+                cpu_add(&cpus, lapic_record->acpi_processor_id, lapic_record->lapic_id);
+                if(lapic_record->lapic_id > max_lapic_id) max_lapic_id = lapic_record->lapic_id;
+                break;
+            case MADT_LX2APIC:
+                if(record->length < sizeof(madt_record_x2apic_t)) {
+                    log(LOG_LEVEL_WARN, "Found MADT x2APIC record that is shorter than expected (%#x/%#x)", record->length, sizeof(madt_record_x2apic_t));
+                    continue;
+                }
 
-                smp_cpu_t *cpu = heap_alloc(sizeof(smp_cpu_t));
-                cpu->next = cpus;
-                cpus = cpu;
+                madt_record_x2apic_t *x2apic_record = (madt_record_x2apic_t *) record;
+                if((x2apic_record->flags & MADT_LAPIC_FLAG_ENABLED) == 0) continue;
 
-                cpu->init_failed = false;
-                cpu->acpi_id = lapic_record->acpi_processor_id;
-                cpu->lapic_id = lapic_record->lapic_id;
-                cpu->park_address = NULL;
-                cpu->is_bsp = false;
-                if(lapic_record->lapic_id == bsp_id) {
-                    cpu->is_bsp = true;
-                    goto success;
-                }
-                cpu->park_address = heap_alloc(sizeof(uint64_t) + sizeof(uint64_t));
-                *cpu->park_address = 0;
+                cpu_add(&cpus, x2apic_record->acpi_processor_uid, x2apic_record->x2apic_id);
+                if(x2apic_record->x2apic_id > max_lapic_id) max_lapic_id = x2apic_record->x2apic_id;
+                break;
+        }
+    }
+
+    // APIC IDs from 0xFF up can only be addressed in x2APIC mode
+    bool x2apic = x86_64_lapic_is_x2apic();
+    if(!x2apic && max_lapic_id >= 0xFF) {
+        if(g_x86_64_cpu_x2apic_support) {
+            x86_64_lapic_enable_x2apic();
+            x2apic = true;
+        } else {
+            log(LOG_LEVEL_WARN, "x2APIC not supported, cpus with an APIC ID above 254 will not be started");
+        }
+    }
+    log(LOG_LEVEL_INFO, "Local APIC in %s mode", x2apic ? "x2APIC" : "xAPIC");
 
-                ap_info->init = 0;
-                ap_info->lapic_id = lapic_record->lapic_id;
-                ap_info->park_address = (uintptr_t) cpu->park_address;
-                ap_info->stack = (uintptr_t) pmm_alloc(PMM_AREA_STANDARD, stack_pgcnt) + (PMM_GRANULARITY * stack_pgcnt) + hhdm_offset;
+    uint32_t bsp_id = x86_64_lapic_id();
+    log(LOG_LEVEL_INFO, "BSP ID: %u", bsp_id);
+    if(!x2apic && bsp_id != x86_64_cpuid(1).ebx >> 24) panic("Current lapic id does not match BSP id");
 
-                asm volatile("" : : : "memory");
+    size_t ap_count = 0;
+    uint32_t bsp_domain = numa_cpu_domain(numa, bsp_id);
+    for(smp_cpu_t *cpu = cpus; cpu != NULL; cpu = cpu->next) {
+        cpu->domain = numa_cpu_domain(numa, cpu->lapic_id);
+        if(cpu->lapic_id == bsp_id) {
+            cpu->is_bsp = true;
+            x86_64_topology_record(cpu->cpuid_dump);
+            continue;
+        }
+        if(!x2apic && cpu->lapic_id >= 0xFF) {
+            cpu->init_failed = true;
+            continue;
+        }
+        ap_count++;
+    }
 
-                x86_64_lapic_ipi_init(lapic_record->lapic_id);
-                x86_64_tsc_block(CYCLES_10MIL);
-                x86_64_lapic_ipi_startup(lapic_record->lapic_id, g_smp_reserved_init_page);
+    // Mailboxes are packed into one array per proximity domain so every AP's is node-local.
+    // The park control line leads the array of the BSP's domain.
+    g_smp_park_control = NULL;
+    for(smp_cpu_t *cpu = cpus; cpu != NULL; cpu = cpu->next) {
+        if(cpu->is_bsp || cpu->init_failed || cpu->park_address != NULL) continue;
 
-                for(int i = 0; i < 1000; i++) {
-                    x86_64_tsc_block(CYCLES_10MIL);
-                    uint8_t value = 0;
-                    asm volatile("lock xadd %0, %1" : "+r"(value) : "m"(ap_info->init) : "memory");
-                    if(value > 0) goto success;
-                }
-                log(LOG_LEVEL_WARN, "AP timed out");
+        size_t mailbox_count = 0;
+        for(smp_cpu_t *other = cpu; other != NULL; other = other->next) {
+            if(!other->is_bsp && !other->init_failed && other->domain == cpu->domain) mailbox_count++;
+        }
 
-                log(LOG_LEVEL_WARN, "Failed to initialize cpu [lapic id %u]", lapic_record->lapic_id);
-                cpu->init_failed = true;
-                break;
+        bool control = g_smp_park_control == NULL && cpu->domain == bsp_domain;
+        size_t park_size = (mailbox_count + (control ? 1 : 0)) * SMP_MAILBOX_SIZE;
+        void *park = numa_alloc_persistent(numa, cpu->domain, MATH_DIV_CEIL(park_size, PMM_GRANULARITY));
+        memset(park, 0, park_size);
+        if(control) {
+            g_smp_park_control = park;
+            park += SMP_MAILBOX_SIZE;
+        }
 
-            success:
-                log(LOG_LEVEL_INFO, "Successfully initialized cpu [lapic id %u]", lapic_record->lapic_id);
-                break;
-            case MADT_LX2APIC: log(LOG_LEVEL_WARN, "x2APIC not currently supported, ignoring MADT entry"); break;
+        for(smp_cpu_t *other = cpu; other != NULL; other = other->next) {
+            if(other->is_bsp || other->init_failed || other->domain != cpu->domain) continue;
+            other->park_address = park;
+            park += SMP_MAILBOX_SIZE;
         }
     }
+    if(g_smp_park_control == NULL) {
+        g_smp_park_control = numa_alloc_persistent(numa, bsp_domain, 1);
+        memset(g_smp_park_control, 0, SMP_MAILBOX_SIZE);
+    }
+
+    // Every AP gets its own slot so they can all be started at once. Slots are persistent as an AP that arrives after the
+    // deadline still reads its slot
+    ap_slot_t *slots = heap_alloc_persistent(sizeof(ap_slot_t) * (ap_count == 0 ? 1 : ap_count));
+    size_t slot_index = 0;
+    for(smp_cpu_t *cpu = cpus; cpu != NULL; cpu = cpu->next) {
+        if(cpu->is_bsp || cpu->init_failed) continue;
+
+        ap_slot_t *slot = &slots[slot_index++];
+        slot->lapic_id = cpu->lapic_id;
+        slot->init = 0;
+        slot->park_address = (uintptr_t) cpu->park_address + hhdm_offset;
+        slot->cpuid_dump = (uintptr_t) cpu->cpuid_dump + hhdm_offset;
+        slot->stack = (uintptr_t) numa_alloc_persistent(numa, cpu->domain, stack_pgcnt) + (PMM_GRANULARITY * stack_pgcnt) + hhdm_offset;
+    }
+
+    ap_info_t *ap_info = (ap_info_t *) (g_smp_reserved_init_page + apinit_size);
+    ap_info->pml4 = (uintptr_t) address_space->top_page_table;
+    ap_info->slots = (uintptr_t) slots + hhdm_offset;
+    ap_info->slot_count = ap_count;
+    ap_info->gdtr_limit = g_x86_64_gdt_limit;
+    ap_info->gdtr_base = (uintptr_t) g_x86_64_gdt;
+    ap_info->set_nx = g_x86_64_cpu_nx_support;
+    ap_info->set_la57 = address_space->level_count == 5;
+    ap_info->pat = g_x86_64_cpu_pat_support ? PTM_X86_64_PAT : 0;
+    ap_info->set_x2apic = x2apic;
+    ap_info->park_control = (uintptr_t) g_smp_park_control + hhdm_offset;
+    ap_info->mwait = g_x86_64_cpu_mwait_support;
+    ap_info->cpuid_count = x86_64_topology_leaf_count();
+    ap_info->xcr0 = g_x86_64_cpu_xcr0;
+    ap_info->mxcsr = X86_64_MXCSR_DEFAULT;
+
+    asm volatile("" : : : "memory");
+
+    // INIT-SIPI-SIPI to all APs in one batch, waiting once per step instead of once per AP
+    log(LOG_LEVEL_INFO, "Starting %zu APs", ap_count);
+    for(size_t i = 0; i < ap_count; i++) x86_64_lapic_ipi_init(slots[i].lapic_id);
+    x86_64_tsc_delay(INIT_DELAY_US);
+    for(size_t i = 0; i < ap_count; i++) x86_64_lapic_ipi_startup(slots[i].lapic_id, g_smp_reserved_init_page);
+    x86_64_tsc_delay(SIPI_DELAY_US);
+    for(size_t i = 0; i < ap_count; i++) {
+        if(slot_ready(&slots[i])) continue;
+        x86_64_lapic_ipi_startup(slots[i].lapic_id, g_smp_reserved_init_page);
+    }
+
+    size_t pending = ap_count;
+    uint64_t deadline = x86_64_tsc_read() + x86_64_tsc_cycles(STARTUP_TIMEOUT_US);
+    while(pending > 0 && x86_64_tsc_read() < deadline) {
+        pending = 0;
+        for(size_t j = 0; j < ap_count; j++) {
+            if(!slot_ready(&slots[j])) pending++;
+        }
+        __builtin_ia32_pause();
+    }
+    if(pending > 0) log(LOG_LEVEL_WARN, "%zu APs timed out", pending);
+
+    slot_index = 0;
+    for(smp_cpu_t *cpu = cpus; cpu != NULL; cpu = cpu->next) {
+        if(!cpu->is_bsp && !cpu->init_failed && !slot_ready(&slots[slot_index++])) {
+            x86_64_lapic_ipi_init(cpu->lapic_id); // Put the AP back into wait-for-SIPI so it cannot start later
+            cpu->init_failed = true;
+        }
+        if(cpu->init_failed) {
+            log(LOG_LEVEL_WARN, "Failed to initialize cpu [lapic id %u]", cpu->lapic_id);
+            continue;
+        }
+        log(LOG_LEVEL_INFO, "Successfully initialized cpu [lapic id %u]", cpu->lapic_id);
+    }
     return cpus;
 }
+
+void smp_ap_bitmap_fill(uint64_t *park_address, smp_bitmap_job_t *job, uint64_t hhdm_offset) {
+    job->done = 0;
+    volatile uint64_t *park = park_address;
+    park[1] = (uintptr_t) job + hhdm_offset;
+    asm volatile("" : : : "memory");
+    park[0] = (uintptr_t) g_smp_reserved_init_page + ((uintptr_t) g_apinit_worker_bitmap - (uintptr_t) g_apinit_start);
+}
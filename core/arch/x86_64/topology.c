@@ -0,0 +1,123 @@
+#include "topology.h"
+
+#define LEAF_BASIC 1
+#define LEAF_CACHE 4
+#define LEAF_TOPOLOGY 0xB
+#define LEAF_TOPOLOGY_V2 0x1F
+#define LEAF_EXTENDED 0x8000'0000
+#define LEAF_EXTENDED_FEATURES 0x8000'0001
+#define LEAF_AMD_CACHE 0x8000'001D
+
+#define LEVEL_TYPE_INVALID 0
+#define LEVEL_TYPE_SMT 1
+
+static struct {
+    size_t count;
+    x86_64_cpuid_registers_t leaves[1 + X86_64_TOPOLOGY_MAX_LEVELS + X86_64_TOPOLOGY_MAX_CACHES];
+
+    size_t topology_index, topology_count;
+    uint32_t cache_leaf;
+    size_t cache_index, cache_count;
+} g_topology = {};
+
+static void leaf_add(uint32_t leaf, uint32_t subleaf) {
+    g_topology.leaves[g_topology.count++] = (x86_64_cpuid_registers_t) {.eax = leaf, .ecx = subleaf};
+}
+
+static uint8_t ceil_log2(uint32_t value) {
+    uint8_t shift = 0;
+    while(((uint64_t) 1 << shift) < value) shift++;
+    return shift;
+}
+
+void x86_64_topology_init() {
+    uint32_t max_leaf = x86_64_cpuid(0).eax;
+    uint32_t max_extended_leaf = x86_64_cpuid(LEAF_EXTENDED).eax;
+
+    // Leaf 1 carries the initial APIC ID and the legacy topology
+    g_topology.count = 0;
+    leaf_add(LEAF_BASIC, 0);
+
+    // Prefer the V2 extended topology leaf, it also describes modules, tiles and dies
+    uint32_t topology_leaf = 0;
+    if(max_leaf >= LEAF_TOPOLOGY_V2 && x86_64_cpuid(LEAF_TOPOLOGY_V2).ebx != 0) {
+        topology_leaf = LEAF_TOPOLOGY_V2;
+    } else if(max_leaf >= LEAF_TOPOLOGY && x86_64_cpuid(LEAF_TOPOLOGY).ebx != 0) {
+        topology_leaf = LEAF_TOPOLOGY;
+    }
+
+    g_topology.topology_index = g_topology.count;
+    for(uint32_t i = 0; topology_leaf != 0 && i < X86_64_TOPOLOGY_MAX_LEVELS; i++) {
+        if(((x86_64_cpuid_subleaf(topology_leaf, i).ecx >> 8) & 0xFF) == LEVEL_TYPE_INVALID) break;
+        leaf_add(topology_leaf, i);
+    }
+    g_topology.topology_count = g_topology.count - g_topology.topology_index;
+
+    // AMD describes caches in its own leaf with the same layout as leaf 4
+    g_topology.cache_leaf = 0;
+    if(max_extended_leaf >= LEAF_AMD_CACHE && (x86_64_cpuid(LEAF_EXTENDED_FEATURES).ecx & (1 << 22)) != 0) {
+        g_topology.cache_leaf = LEAF_AMD_CACHE;
+    } else if(max_leaf >= LEAF_CACHE) {
+        g_topology.cache_leaf = LEAF_CACHE;
+    }
+
+    g_topology.cache_index = g_topology.count;
+    for(uint32_t i = 0; g_topology.cache_leaf != 0 && i < X86_64_TOPOLOGY_MAX_CACHES; i++) {
+        if((x86_64_cpuid_subleaf(g_topology.cache_leaf, i).eax & 0x1F) == 0) break;
+        leaf_add(g_topology.cache_leaf, i);
+    }
+    g_topology.cache_count = g_topology.count - g_topology.cache_index;
+}
+
+size_t x86_64_topology_leaf_count() {
+    return g_topology.count;
+}
+
+void x86_64_topology_prepare(x86_64_cpuid_registers_t *dump) {
+    for(size_t i = 0; i < g_topology.count; i++) dump[i] = g_topology.leaves[i];
+}
+
+void x86_64_topology_record(x86_64_cpuid_registers_t *dump) {
+    for(size_t i = 0; i < g_topology.count; i++) dump[i] = x86_64_cpuid_subleaf(g_topology.leaves[i].eax, g_topology.leaves[i].ecx);
+}
+
+void x86_64_topology_decode(x86_64_cpuid_registers_t *dump, x86_64_topology_t *topology) {
+    topology->apic_id = dump[0].ebx >> 24;
+    topology->smt_shift = 0;
+    topology->package_shift = 0;
+
+    if(g_topology.topology_count > 0) {
+        for(size_t i = 0; i < g_topology.topology_count; i++) {
+            x86_64_cpuid_registers_t *level = &dump[g_topology.topology_index + i];
+            if(((level->ecx >> 8) & 0xFF) == LEVEL_TYPE_SMT) topology->smt_shift = level->eax & 0x1F;
+
+            // Levels are reported bottom up, the last one reaches up to the package
+            topology->package_shift = level->eax & 0x1F;
+            topology->apic_id = level->edx;
+        }
+    } else if((dump[0].edx & (1 << 28)) != 0) {
+        // Without the extended topology leaves, leaf 1 gives the logical CPUs per package and leaf 4 the cores
+        topology->package_shift = ceil_log2((dump[0].ebx >> 16) & 0xFF);
+
+        uint32_t core_count = 1;
+        if(g_topology.cache_leaf == LEAF_CACHE && g_topology.cache_count > 0) core_count = ((dump[g_topology.cache_index].eax >> 26) & 0x3F) + 1;
+        uint8_t core_bits = ceil_log2(core_count);
+        topology->smt_shift = topology->package_shift > core_bits ? topology->package_shift - core_bits : 0;
+    }
+
+    topology->cache_count = 0;
+    for(size_t i = 0; i < g_topology.cache_count; i++) {
+        x86_64_cpuid_registers_t *descriptor = &dump[g_topology.cache_index + i];
+        uint8_t type = descriptor->eax & 0x1F;
+        if(type < X86_64_CACHE_TYPE_DATA || type > X86_64_CACHE_TYPE_UNIFIED) continue;
+
+        x86_64_cache_t *cache = &topology->caches[topology->cache_count++];
+        cache->level = (descriptor->eax >> 5) & 0x7;
+        cache->type = type;
+        cache->line_size = (descriptor->ebx & 0xFFF) + 1;
+        cache->ways = ((descriptor->ebx >> 22) & 0x3FF) + 1;
+        cache->sets = descriptor->ecx + 1;
+        cache->size = (uint64_t) cache->ways * (((descriptor->ebx >> 12) & 0x3FF) + 1) * cache->line_size * cache->sets;
+        cache->sharing_shift = ceil_log2(((descriptor->eax >> 14) & 0xFFF) + 1);
+    }
+}
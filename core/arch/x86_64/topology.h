@@ -0,0 +1,51 @@
+#pragma once
+
+#include "arch/x86_64/cpuid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define X86_64_TOPOLOGY_MAX_LEVELS 8
+#define X86_64_TOPOLOGY_MAX_CACHES 8
+
+typedef enum : uint8_t {
+    X86_64_CACHE_TYPE_DATA = 1,
+    X86_64_CACHE_TYPE_INSTRUCTION = 2,
+    X86_64_CACHE_TYPE_UNIFIED = 3
+} x86_64_cache_type_t;
+
+typedef struct {
+    uint8_t level;
+    x86_64_cache_type_t type;
+    uint16_t line_size;
+    uint16_t ways;
+    uint32_t sets;
+    uint64_t size;
+    /// CPUs with equal APIC IDs after shifting right by this share the cache
+    uint8_t sharing_shift;
+} x86_64_cache_t;
+
+typedef struct {
+    uint32_t apic_id;
+    uint8_t smt_shift;
+    uint8_t package_shift;
+
+    size_t cache_count;
+    x86_64_cache_t caches[X86_64_TOPOLOGY_MAX_CACHES];
+} x86_64_topology_t;
+
+/// Work out which CPUID leaves describe the topology and caches, from the BSP.
+void x86_64_topology_init();
+
+/// Number of CPUID leaves every CPU records.
+size_t x86_64_topology_leaf_count();
+
+/// Fill `dump` with the leaves to record, the leaf in `eax` and the subleaf in `ecx`.
+/// The apinit trampoline executes each entry in place, so APs record without calling into C.
+void x86_64_topology_prepare(x86_64_cpuid_registers_t *dump);
+
+/// Record the prepared leaves on the current CPU.
+void x86_64_topology_record(x86_64_cpuid_registers_t *dump);
+
+/// Decode a recorded dump.
+void x86_64_topology_decode(x86_64_cpuid_registers_t *dump, x86_64_topology_t *topology);
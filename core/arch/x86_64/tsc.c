@@ -1,11 +1,140 @@
 #include "tsc.h"
 
+#include "common/log.h"
+#include "dev/acpi/tables/fadt.h"
+#include "dev/acpi/tables/hpet.h"
+
+#include "arch/x86_64/cpuid.h"
+#include "arch/x86_64/port.h"
+
+#include <stddef.h>
+
+#define FALLBACK_FREQUENCY 4'000'000'000
+#define CALIBRATION_US 10'000
+#define CALIBRATION_TIMEOUT_US 100'000
+
+#define PM_TIMER_FREQUENCY 3'579'545
+
+#define HPET_REG_PERIOD 0x4
+#define HPET_REG_CONFIG 0x10
+#define HPET_REG_COUNTER 0xF0
+#define HPET_CONFIG_ENABLE (1 << 0)
+#define HPET_MAX_PERIOD 100'000'000
+#define HPET_REGS_SIZE 0x400
+
+#define ENTRY_FLAG_PRESENT (1 << 0)
+#define ENTRY_FLAG_PS (1 << 7)
+#define ENTRY_ADDRESS_MASK ((uint64_t) 0x000F'FFFF'FFFF'F000)
+
+uint64_t g_x86_64_tsc_frequency = 0;
+x86_64_tsc_source_t g_x86_64_tsc_source = X86_64_TSC_SOURCE_NONE;
+bool g_x86_64_tsc_invariant = false;
+
 static inline uint64_t read() {
     uint32_t high, low;
     asm volatile("rdtsc" : "=a"(low), "=d"(high));
     return ((uint64_t) high << 32) | low;
 }
 
+/// Crystal clock based frequency from leaf 0x15, falling back to the base frequency of leaf 0x16.
+static uint64_t cpuid_frequency() {
+    uint32_t max_leaf = x86_64_cpuid(0).eax;
+    if(max_leaf < 0x15) return 0;
+
+    x86_64_cpuid_registers_t tsc = x86_64_cpuid(0x15);
+    uint64_t base = max_leaf >= 0x16 ? (uint64_t) (x86_64_cpuid(0x16).eax & 0xFFFF) * 1'000'000 : 0;
+    if(tsc.eax == 0 || tsc.ebx == 0) return base;
+
+    // Some CPUs enumerate the ratio but not the crystal, the TSC then runs at the base frequency
+    uint64_t crystal = tsc.ecx;
+    if(crystal == 0) return base;
+    return crystal * tsc.ebx / tsc.eax;
+}
+
+/// Whether MMIO at `address` can be accessed as is.
+static bool mmio_accessible(uint64_t address, uint64_t length) {
+#ifdef __PLATFORM_X86_64_UEFI
+    // Boot services are gone, the registers can only be used if the firmware tables still map them
+    uintptr_t cr3, cr4;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    for(uint64_t page = address & ~(uint64_t) 0xFFF; page < address + length; page += 0x1000) {
+        uint64_t *table = (uint64_t *) (cr3 & ENTRY_ADDRESS_MASK);
+        for(int level = (cr4 & (1 << 12)) != 0 ? 5 : 4; level > 0; level--) {
+            uint64_t entry = table[(page >> (level * 9 + 3)) & 0x1FF];
+            if((entry & ENTRY_FLAG_PRESENT) == 0) return false;
+            if(level == 1 || (level <= 3 && (entry & ENTRY_FLAG_PS) != 0)) break;
+            table = (uint64_t *) (uintptr_t) (entry & ENTRY_ADDRESS_MASK);
+        }
+    }
+    return true;
+#else
+    // Paging is off until handoff, everything the address size reaches is accessible
+    return address + length - 1 <= UINTPTR_MAX;
+#endif
+}
+
+static uint64_t pm_timer_frequency(acpi_rsdp_t *rsdp) {
+    fadt_t *fadt = (fadt_t *) acpi_find_table(rsdp, "FACP");
+    if(fadt == NULL) return 0;
+
+    uint16_t port = fadt->pm_tmr_blk;
+    if(fadt->sdt_header.length >= sizeof(fadt_t) && fadt->x_pm_tmr_blk.address != 0) {
+        if(fadt->x_pm_tmr_blk.address_space != ACPI_GAS_SPACE_IO) return 0;
+        port = fadt->x_pm_tmr_blk.address;
+    }
+    if(port == 0) return 0;
+
+    uint32_t mask = (fadt->flags & FADT_FLAG_TMR_VAL_EXT) != 0 ? 0xFFFF'FFFF : 0xFF'FFFF;
+    uint32_t target = (uint64_t) PM_TIMER_FREQUENCY * CALIBRATION_US / 1'000'000;
+
+    uint32_t start = x86_64_port_inl(port) & mask;
+    uint64_t tsc_start = read();
+    uint64_t deadline = tsc_start + x86_64_tsc_cycles(CALIBRATION_TIMEOUT_US);
+    uint32_t elapsed;
+    do {
+        if(read() > deadline) return 0; // The timer does not tick
+        elapsed = ((x86_64_port_inl(port) & mask) - start) & mask;
+    } while(elapsed < target);
+    uint64_t tsc_elapsed = read() - tsc_start;
+
+    return tsc_elapsed * PM_TIMER_FREQUENCY / elapsed;
+}
+
+static uint64_t hpet_frequency(acpi_rsdp_t *rsdp) {
+    hpet_t *hpet = (hpet_t *) acpi_find_table(rsdp, "HPET");
+    if(hpet == NULL || hpet->base_address.address_space != ACPI_GAS_SPACE_MEMORY) return 0;
+    if(!mmio_accessible(hpet->base_address.address, HPET_REGS_SIZE)) return 0;
+
+    // Registers are read 32 bits at a time, the BIOS build cannot do 64-bit MMIO accesses
+    uintptr_t base = hpet->base_address.address;
+    volatile uint32_t *period = (volatile uint32_t *) (base + HPET_REG_PERIOD);
+    volatile uint32_t *config = (volatile uint32_t *) (base + HPET_REG_CONFIG);
+    volatile uint32_t *counter = (volatile uint32_t *) (base + HPET_REG_COUNTER);
+
+    uint64_t period_fs = *period;
+    if(period_fs == 0 || period_fs > HPET_MAX_PERIOD) return 0;
+
+    uint32_t original_config = *config;
+    if((original_config & HPET_CONFIG_ENABLE) == 0) *config = original_config | HPET_CONFIG_ENABLE;
+
+    uint32_t target = (uint64_t) CALIBRATION_US * 1'000'000'000 / period_fs;
+    uint32_t start = *counter;
+    uint64_t tsc_start = read();
+    uint64_t deadline = tsc_start + x86_64_tsc_cycles(CALIBRATION_TIMEOUT_US);
+    uint32_t elapsed;
+    do {
+        elapsed = *counter - start;
+    } while(elapsed < target && read() <= deadline);
+    uint64_t tsc_elapsed = read() - tsc_start;
+
+    *config = original_config;
+    if(elapsed < target) return 0; // The counter does not move
+
+    uint64_t elapsed_ns = (uint64_t) elapsed * period_fs / 1'000'000;
+    return tsc_elapsed * 1'000'000'000 / elapsed_ns;
+}
+
 uint64_t x86_64_tsc_read() {
     return read();
 }
@@ -14,3 +143,31 @@ void x86_64_tsc_block(uint64_t cycles) {
     uint64_t target = read() + cycles;
     while(read() < target);
 }
+
+void x86_64_tsc_calibrate(acpi_rsdp_t *rsdp) {
+    if(x86_64_cpuid(0x8000'0000).eax >= 0x8000'0007) g_x86_64_tsc_invariant = (x86_64_cpuid(0x8000'0007).edx & (1 << 8)) != 0;
+
+    g_x86_64_tsc_frequency = cpuid_frequency();
+    if(g_x86_64_tsc_frequency != 0) {
+        g_x86_64_tsc_source = X86_64_TSC_SOURCE_CPUID;
+    } else if(rsdp != NULL && (g_x86_64_tsc_frequency = pm_timer_frequency(rsdp)) != 0) {
+        g_x86_64_tsc_source = X86_64_TSC_SOURCE_PM_TIMER;
+    } else if(rsdp != NULL && (g_x86_64_tsc_frequency = hpet_frequency(rsdp)) != 0) {
+        g_x86_64_tsc_source = X86_64_TSC_SOURCE_HPET;
+    }
+
+    if(g_x86_64_tsc_source == X86_64_TSC_SOURCE_NONE) {
+        log(LOG_LEVEL_WARN, "unable to determine the TSC frequency");
+        return;
+    }
+    log(LOG_LEVEL_INFO, "TSC frequency %llu Hz (%s%s)", g_x86_64_tsc_frequency, g_x86_64_tsc_source == X86_64_TSC_SOURCE_CPUID ? "cpuid" : (g_x86_64_tsc_source == X86_64_TSC_SOURCE_PM_TIMER ? "pm timer" : "hpet"), g_x86_64_tsc_invariant ? ", invariant" : "");
+}
+
+uint64_t x86_64_tsc_cycles(uint64_t microseconds) {
+    uint64_t frequency = g_x86_64_tsc_frequency != 0 ? g_x86_64_tsc_frequency : FALLBACK_FREQUENCY;
+    return microseconds * frequency / 1'000'000;
+}
+
+void x86_64_tsc_delay(uint64_t microseconds) {
+    x86_64_tsc_block(x86_64_tsc_cycles(microseconds));
+}
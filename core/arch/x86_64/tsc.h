@@ -1,6 +1,30 @@
 #pragma once
 
+#include "dev/acpi.h"
+
 #include <stdint.h>
 
+typedef enum {
+    X86_64_TSC_SOURCE_NONE,
+    X86_64_TSC_SOURCE_CPUID,
+    X86_64_TSC_SOURCE_PM_TIMER,
+    X86_64_TSC_SOURCE_HPET
+} x86_64_tsc_source_t;
+
+/// TSC frequency in Hz, zero until calibrated or when it could not be determined
+extern uint64_t g_x86_64_tsc_frequency;
+extern x86_64_tsc_source_t g_x86_64_tsc_source;
+/// The TSC ticks at a constant rate across P-, C- and T-states
+extern bool g_x86_64_tsc_invariant;
+
 uint64_t x86_64_tsc_read();
-void x86_64_tsc_block(uint64_t cycles);
\ No newline at end of file
+void x86_64_tsc_block(uint64_t cycles);
+
+/// Determine the TSC frequency, from CPUID leaves 0x15/0x16 or by calibrating against the ACPI PM timer or the HPET.
+void x86_64_tsc_calibrate(acpi_rsdp_t *rsdp);
+
+/// Cycles in `microseconds`, assumes a fast TSC when the frequency is unknown so delays err on the long side.
+uint64_t x86_64_tsc_cycles(uint64_t microseconds);
+
+/// Spin for `microseconds`.
+void x86_64_tsc_delay(uint64_t microseconds);
\ No newline at end of file
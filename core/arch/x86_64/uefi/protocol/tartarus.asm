@@ -1,7 +1,15 @@
 global x86_64_protocol_tartarus_handoff
+global x86_64_protocol_tartarus_handoff_end
+global g_x86_64_protocol_tartarus_la57_start
+global g_x86_64_protocol_tartarus_la57_end
+
+%define la57_off(addr) (addr - g_x86_64_protocol_tartarus_la57_start)
 
 bits 64
 x86_64_protocol_tartarus_handoff:
+    test r9, r9
+    jnz .la57                                   ; A trampoline is passed when switching to 5-level paging
+
     mov cr3, rdx                                ; Load page tables
 
     mov rax, cr0
@@ -30,3 +38,117 @@ x86_64_protocol_tartarus_handoff:
     cld
 
     jmp rax
+
+.la57:
+    mov qword [r9 + la57_off(la57_info.entry)], rdi
+    mov qword [r9 + la57_off(la57_info.stack)], rsi
+    mov dword [r9 + la57_off(la57_info.top_page_table)], edx
+    mov qword [r9 + la57_off(la57_info.boot_info)], rcx
+    mov qword [r9 + la57_off(la57_info.version)], r8
+
+    lea rax, [r9 + la57_off(la57_gdt)]
+    mov qword [r9 + la57_off(la57_gdtr.base)], rax
+    lgdt [r9 + la57_off(la57_gdtr)]             ; Load the trampoline GDT
+
+    mov rax, cr4
+    and rax, ~(1 << 17)                         ; Clear PCIDE, paging cannot be disabled with it set
+    mov cr4, rax
+
+    mov rbx, r9                                 ; Keep the trampoline base in a register that exists in compatibility mode
+    lea rsp, [r9 + 0x1000]                      ; Stack at the end of the trampoline page
+
+    lea rax, [r9 + la57_off(la57_compat)]
+    push qword 0x18                             ; Code32 selector
+    push rax
+    retfq
+
+; Copied into a low page by the C side. LA57 can only be changed with paging disabled, so drop
+; into compatibility mode, disable paging, enable LA57, then re-enter long mode on the kernel tables.
+; Entered with ebx = trampoline base.
+g_x86_64_protocol_tartarus_la57_start:
+bits 32
+la57_compat:
+    mov eax, 0x20                               ; Data32 selector
+    mov ds, eax
+    mov es, eax
+    mov ss, eax
+
+    mov eax, cr0
+    and eax, ~(1 << 31)                         ; Clear paging bit, leaves long mode
+    mov cr0, eax
+
+    mov eax, cr4
+    or eax, (1 << 12) | (1 << 5)                ; Set LA57 & PAE bits
+    mov cr4, eax
+
+    mov eax, dword [ebx + la57_off(la57_info.top_page_table)]
+    mov cr3, eax                                ; Load page tables
+
+    mov eax, cr0
+    or eax, (1 << 31) | (1 << 16)               ; Set paging bit & write protect bits
+    mov cr0, eax
+
+    lea eax, [ebx + la57_off(la57_long)]
+    push dword 0x28                             ; Code64 selector
+    push eax
+    retf
+
+bits 64
+la57_long:
+    mov ebx, ebx                                ; Upper halves are undefined after compatibility mode
+
+    mov rax, 0x30                               ; Data64 selector
+    mov ss, rax
+
+    xor rax, rax
+    mov ds, rax
+    mov es, rax
+    mov fs, rax
+    mov gs, rax
+
+    mov rax, qword [rbx + la57_off(la57_info.entry)]
+    mov rdi, qword [rbx + la57_off(la57_info.boot_info)]
+    mov rsi, qword [rbx + la57_off(la57_info.version)]
+
+    xor rbp, rbp
+    mov rsp, qword [rbx + la57_off(la57_info.stack)]
+    push qword 0                                ; Push an invalid return address
+
+    xor rbx, rbx
+    xor rcx, rcx
+    xor rdx, rdx
+    xor r8, r8
+    xor r9, r9
+    xor r10, r10
+    xor r11, r11
+    xor r12, r12
+    xor r13, r13
+    xor r14, r14
+    xor r15, r15
+    cld
+
+    jmp rax
+
+; Same layout as g_x86_64_gdt, so the kernel is entered with the same selectors as with 4-level paging
+align 8
+la57_gdt:
+    dq 0                                        ; Null
+    dq 0x000F9B000000FFFF                       ; Code16
+    dq 0x000F93000000FFFF                       ; Data16
+    dq 0x00CF9B000000FFFF                       ; Code32
+    dq 0x00CF93000000FFFF                       ; Data32
+    dq 0x00209B0000000000                       ; Code64
+    dq 0x0000930000000000                       ; Data64
+
+la57_gdtr:
+    dw 7 * 8 - 1
+    .base: dq 0
+
+la57_info:
+    .entry: dq 0
+    .stack: dq 0
+    .boot_info: dq 0
+    .version: dq 0
+    .top_page_table: dd 0
+g_x86_64_protocol_tartarus_la57_end:
+x86_64_protocol_tartarus_handoff_end:
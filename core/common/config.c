@@ -9,6 +9,10 @@
 #define IS_WHITESPACE(CHAR) ((CHAR) == ' ' || (CHAR) == '\t')
 #define IS_ALPHA(CHAR) (((CHAR) >= 'a' && (CHAR) <= 'z') || ((CHAR) >= 'A' && (CHAR) <= 'Z'))
 #define IS_NUMERIC(CHAR) ((CHAR) >= '0' && (CHAR) <= '9')
+#define TO_LOWER(CHAR) (((CHAR) >= 'A' && (CHAR) <= 'Z') ? (CHAR) + ('a' - 'A') : (CHAR))
+
+#define FNV_OFFSET_BASIS 0xCBF2'9CE4'8422'2325
+#define FNV_PRIME 0x100'0000'01B3
 
 typedef enum {
     TOKEN_KIND_EOF,
@@ -30,16 +34,58 @@ typedef struct {
     size_t size, cursor;
 } buffer_t;
 
-static config_entry_t *find_entry(config_t *config, config_entry_type_t type, const char *key, size_t index) {
+/// Case-insensitive FNV-1a of the key, mixed with the entry type.
+static uint64_t hash_key(const char *key, config_entry_type_t type) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for(size_t i = 0; key[i] != '\0'; i++) {
+        hash ^= (uint8_t) TO_LOWER(key[i]);
+        hash *= FNV_PRIME;
+    }
+    hash ^= type;
+    hash *= FNV_PRIME;
+    return hash;
+}
+
+static config_index_slot_t *find_slot(config_t *config, const char *key, config_entry_type_t type) {
+    size_t mask = config->index_capacity - 1;
+    for(size_t i = hash_key(key, type) & mask;; i = (i + 1) & mask) {
+        config_index_slot_t *slot = &config->index[i];
+        if(slot->key == NULL || (slot->type == type && string_case_eq(slot->key, key))) return slot;
+    }
+}
+
+/// Build the index in two passes, counting entries per slot and then handing out ranges of a single entry pointer array.
+static void build_index(config_t *config) {
+    config->index_capacity = 16;
+    while(config->index_capacity < config->entry_count * 2) config->index_capacity *= 2;
+    config->index = heap_alloc(sizeof(config_index_slot_t) * config->index_capacity);
+    memset(config->index, 0, sizeof(config_index_slot_t) * config->index_capacity);
+
     for(size_t i = 0; i < config->entry_count; i++) {
-        if(config->entries[i].type != type || !string_case_eq(config->entries[i].key, key)) continue;
-        if(index != 0) {
-            index--;
-            continue;
-        }
-        return &config->entries[i];
+        config_index_slot_t *slot = find_slot(config, config->entries[i].key, config->entries[i].type);
+        slot->key = config->entries[i].key;
+        slot->type = config->entries[i].type;
+        slot->count++;
+    }
+
+    config_entry_t **entries = heap_alloc(sizeof(config_entry_t *) * (config->entry_count > 0 ? config->entry_count : 1));
+    for(size_t i = 0; i < config->index_capacity; i++) {
+        if(config->index[i].key == NULL) continue;
+        config->index[i].entries = entries;
+        entries += config->index[i].count;
+        config->index[i].count = 0;
+    }
+
+    for(size_t i = 0; i < config->entry_count; i++) {
+        config_index_slot_t *slot = find_slot(config, config->entries[i].key, config->entries[i].type);
+        slot->entries[slot->count++] = &config->entries[i];
     }
-    return NULL;
+}
+
+static config_entry_t *find_entry(config_t *config, config_entry_type_t type, const char *key, size_t index) {
+    config_index_slot_t *slot = find_slot(config, key, type);
+    if(slot->key == NULL || index >= slot->count) return NULL;
+    return slot->entries[index];
 }
 
 static token_t read_token(buffer_t *buffer) {
@@ -85,14 +131,29 @@ static token_t read_token(buffer_t *buffer) {
     return token;
 }
 
+static bool token_case_eq(buffer_t *buffer, token_t token, const char *str) {
+    for(size_t i = 0; i < token.length; i++) {
+        if(str[i] == '\0' || TO_LOWER(buffer->data[token.start + i]) != TO_LOWER(str[i])) return false;
+    }
+    return str[token.length] == '\0';
+}
+
 config_t *config_parse(vfs_node_t *config_node) {
     config_t *config = heap_alloc(sizeof(config_t));
     config->entry_count = 0;
-    config->entries = NULL;
 
+    // The file stays resident, keys and strings point into it and are terminated in place
     size_t config_size = config_node->ops->get_size(config_node);
-    char *buffer_data = heap_alloc(config_size);
+    char *buffer_data = heap_alloc(config_size + 1);
     config_node->ops->read(config_node, buffer_data, 0, config_size);
+    buffer_data[config_size] = '\0';
+
+    // Every entry takes a line, so the line count bounds the entry count
+    size_t max_entry_count = 1;
+    for(size_t i = 0; i < config_size; i++) {
+        if(buffer_data[i] == '\n') max_entry_count++;
+    }
+    config->entries = heap_alloc(sizeof(config_entry_t) * max_entry_count);
 
     buffer_t buffer = {.data = buffer_data, .size = config_size, .cursor = 0};
     bool expect_newline = false;
@@ -106,62 +167,52 @@ config_t *config_parse(vfs_node_t *config_node) {
             if(read_token(&buffer).kind != TOKEN_KIND_EQUAL) panic("config parse failed: expected `=` got `%.*s`", token.length, &buffer.data[token.start]);
             token_t token_value = read_token(&buffer);
 
-            char *key = heap_alloc(token.length + 1);
-            memcpy(key, &buffer.data[token.start], token.length);
-            key[token.length] = '\0';
-
-            config->entries = heap_realloc(config->entries, sizeof(config_entry_t) * ++config->entry_count);
-            config->entries[config->entry_count - 1].key = key;
+            config_entry_t *entry = &config->entries[config->entry_count++];
+            entry->key = &buffer_data[token.start];
 
             switch(token_value.kind) {
-                case TOKEN_KIND_IDENTIFIER: {
-                    bool value;
-
-                    char *strval = heap_alloc(token_value.length + 1);
-                    memcpy(strval, &buffer.data[token_value.start], token_value.length);
-                    strval[token_value.length] = '\0';
-                    if(string_case_eq(strval, "true")) {
-                        value = true;
-                    } else if(string_case_eq(strval, "false")) {
-                        value = false;
+                case TOKEN_KIND_IDENTIFIER:
+                    if(token_case_eq(&buffer, token_value, "true")) {
+                        entry->value.boolean = true;
+                    } else if(token_case_eq(&buffer, token_value, "false")) {
+                        entry->value.boolean = false;
                     } else {
                         panic("config parse failed: invalid config entry token `%.*s`", token_value.length, &buffer.data[token_value.start]);
                     }
-                    heap_free(strval);
-
-                    config->entries[config->entry_count - 1].type = CONFIG_ENTRY_TYPE_BOOLEAN;
-                    config->entries[config->entry_count - 1].value.boolean = value;
-                } break;
-                case TOKEN_KIND_STRING: {
-                    char *value = heap_alloc(token_value.length + 1);
-                    memcpy(value, &buffer.data[token_value.start], token_value.length);
-                    value[token_value.length] = '\0';
-                    config->entries[config->entry_count - 1].type = CONFIG_ENTRY_TYPE_STRING;
-                    config->entries[config->entry_count - 1].value.string = value;
-                } break;
+                    entry->type = CONFIG_ENTRY_TYPE_BOOLEAN;
+                    break;
+                case TOKEN_KIND_STRING:
+                    // Terminates on the closing quote, which was already consumed
+                    buffer_data[token_value.start + token_value.length] = '\0';
+                    entry->type = CONFIG_ENTRY_TYPE_STRING;
+                    entry->value.string = &buffer_data[token_value.start];
+                    break;
                 case TOKEN_KIND_NUMBER: {
                     uintmax_t value = 0;
                     for(size_t i = 0; i < token_value.length; i++) {
                         value *= 10;
                         value += buffer.data[token_value.start + i] - '0';
                     }
-                    config->entries[config->entry_count - 1].type = CONFIG_ENTRY_TYPE_NUMBER;
-                    config->entries[config->entry_count - 1].value.number = value;
+                    entry->type = CONFIG_ENTRY_TYPE_NUMBER;
+                    entry->value.number = value;
                 } break;
                 default: panic("config parse failed: invalid config entry token `%.*s`", token_value.length, &buffer.data[token_value.start]);
             }
+
+            // Terminates on the whitespace or `=` following the key, which was already consumed
+            buffer_data[token.start + token.length] = '\0';
             expect_newline = true;
         }
     }
 
-    heap_free(buffer_data);
+    build_index(config);
     return config;
 }
 
 size_t config_key_count(config_t *config, const char *key, config_entry_type_t type) {
-    size_t count = 0;
-    while(find_entry(config, type, key, count) != NULL) count++;
-    return count;
+    config_index_slot_t *slot = find_slot(config, key, type);
+    if(slot->key == NULL) return 0;
+    return slot->count;
 }
 
 const char *config_find_string(config_t *config, const char *key, const char *default_value) {
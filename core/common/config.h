@@ -20,9 +20,21 @@ typedef struct {
     } value;
 } config_entry_t;
 
+/// Entries sharing a key (case-insensitively) and type, in file order
+typedef struct {
+    const char *key;
+    config_entry_type_t type;
+    size_t count;
+    config_entry_t **entries;
+} config_index_slot_t;
+
 typedef struct {
     config_entry_t *entries;
     size_t entry_count;
+
+    /// Open addressing hash table, the capacity is a power of two
+    config_index_slot_t *index;
+    size_t index_capacity;
 } config_t;
 
 config_t *config_parse(vfs_node_t *config_node);
@@ -15,6 +15,9 @@
 
 #define ELF_MAGIC "\x7f" "ELF"
 
+#define SPARSE_SPAN_FACTOR 2
+#define MAX_ALIGNMENT PTM_PAGE_SIZE_1G
+
 #define PT_NULL 0
 #define PT_LOAD 1
 #define PT_DYNAMIC 2
@@ -90,6 +93,32 @@ typedef struct {
     uint64_t size;
 } region_load_t;
 
+/// Insertion sort by file offset, kernels only have a handful of segments.
+static void sort_loads(region_load_t *loads, size_t count) {
+    for(size_t i = 1; i < count; i++) {
+        region_load_t load = loads[i];
+        size_t j = i;
+        for(; j > 0 && loads[j - 1].offset > load.offset; j--) loads[j] = loads[j - 1];
+        loads[j] = load;
+    }
+}
+
+/// Physical alignment a region wants, `p_align` or a huge page when the region is large enough to be mapped with one.
+static size_t region_alignment(uint64_t p_align, size_t aligned_size) {
+    size_t alignment = PMM_GRANULARITY;
+    if(p_align > alignment && (p_align & (p_align - 1)) == 0) alignment = p_align > MAX_ALIGNMENT ? MAX_ALIGNMENT : p_align;
+    if(aligned_size >= PTM_PAGE_SIZE_2M && alignment < PTM_PAGE_SIZE_2M) alignment = PTM_PAGE_SIZE_2M;
+    return alignment;
+}
+
+/// Allocate `size` bytes at a physical address congruent to `vaddr` modulo `alignment`, so huge leaves can line up.
+static uint64_t alloc_congruent(uint64_t vaddr, size_t size, size_t alignment) {
+    size_t head = vaddr % alignment;
+    void *base = pmm_alloc_ext(PMM_AREA_STANDARD, (head + size) / PMM_GRANULARITY, alignment, PMM_MAP_TYPE_ALLOCATED);
+    if(head != 0) pmm_free(base, head / PMM_GRANULARITY);
+    return (uintptr_t) base + head;
+}
+
 static bool validate_elf(elf64_header_t *header) {
     if(memcmp(header->identifier.magic, ELF_MAGIC, 4) != 0) {
         log(LOG_LEVEL_ERROR, "elf: invalid identififer");
@@ -142,6 +171,19 @@ static bool read_header(vfs_node_t *file, elf64_header_t *header) {
 elf_loaded_image_t *elf_load(vfs_node_t *file, void *address_space) {
     elf64_header_t header;
     if(!read_header(file, &header)) return NULL;
+    if(header.program_header_entry_size < sizeof(elf64_program_header_t)) {
+        log(LOG_LEVEL_WARN, "elf: program header entries are too small (%u)", header.program_header_entry_size);
+        return NULL;
+    }
+
+    // Read the whole program header table at once
+    size_t program_headers_size = (size_t) header.program_header_entry_size * header.program_header_entry_count;
+    void *program_headers = heap_alloc(program_headers_size);
+    if(file->ops->read(file, program_headers, header.program_header_offset, program_headers_size) != program_headers_size) {
+        log(LOG_LEVEL_WARN, "elf: unable to read program headers");
+        heap_free(program_headers);
+        return NULL;
+    }
 
     elf64_addr_t lowest_vaddr = UINT64_MAX;
     elf64_addr_t highest_vaddr = 0;
@@ -149,19 +191,19 @@ elf_loaded_image_t *elf_load(vfs_node_t *file, void *address_space) {
     elf_region_t **regions = NULL;
     size_t region_count = 0;
 
-    region_load_t **loads = NULL;
+    region_load_t *loads = heap_alloc(sizeof(region_load_t) * (header.program_header_entry_count > 0 ? header.program_header_entry_count : 1));
     size_t load_count = 0;
 
     for(elf64_half_t i = 0; i < header.program_header_entry_count; i++) {
-        elf64_program_header_t program_header;
-        if(file->ops->read(file, &program_header, header.program_header_offset + header.program_header_entry_size * i, header.program_header_entry_size) != header.program_header_entry_size) {
-            log(LOG_LEVEL_WARN, "elf: unable to read program header %u", i);
+        elf64_program_header_t *program_header = program_headers + (size_t) header.program_header_entry_size * i;
+        if(program_header->type != PT_LOAD || program_header->memsz == 0) continue;
+        if(program_header->filesz > program_header->memsz) {
+            log(LOG_LEVEL_WARN, "elf: program header %u has more file than memory size", i);
             return NULL;
         }
-        if(program_header.type != PT_LOAD || program_header.memsz == 0) continue;
 
-        elf64_addr_t aligned_vaddr = program_header.vaddr - program_header.vaddr % PMM_GRANULARITY;
-        elf64_xword_t aligned_size = MATH_CEIL(program_header.memsz + (program_header.vaddr % PMM_GRANULARITY), PMM_GRANULARITY);
+        elf64_addr_t aligned_vaddr = program_header->vaddr - program_header->vaddr % PMM_GRANULARITY;
+        elf64_xword_t aligned_size = MATH_CEIL(program_header->memsz + (program_header->vaddr % PMM_GRANULARITY), PMM_GRANULARITY);
 
         for(size_t j = 0; j < region_count; j++) {
             if(aligned_vaddr < regions[j]->aligned_vaddr + regions[j]->aligned_size && regions[j]->aligned_vaddr < aligned_vaddr + aligned_size) {
@@ -174,56 +216,79 @@ elf_loaded_image_t *elf_load(vfs_node_t *file, void *address_space) {
         if(aligned_vaddr + aligned_size > highest_vaddr) highest_vaddr = aligned_vaddr + aligned_size;
 
         elf_region_t *region = heap_alloc(sizeof(elf_region_t));
-        region->real_vaddr = program_header.vaddr;
+        region->real_vaddr = program_header->vaddr;
         region->aligned_vaddr = aligned_vaddr;
         region->aligned_size = aligned_size;
-        region->read = (program_header.flags & PTM_FLAG_READ) != 0;
-        region->write = (program_header.flags & PTM_FLAG_WRITE) != 0;
-        region->execute = (program_header.flags & PTM_FLAG_EXEC) != 0;
+        region->alignment = region_alignment(program_header->alignment, aligned_size);
+        region->read = (program_header->flags & PTM_FLAG_READ) != 0;
+        region->write = (program_header->flags & PTM_FLAG_WRITE) != 0;
+        region->execute = (program_header->flags & PTM_FLAG_EXEC) != 0;
         regions = heap_realloc(regions, ++region_count * sizeof(elf_region_t *));
         regions[region_count - 1] = region;
 
-        if(program_header.type != PT_LOAD) continue;
-
-        region_load_t *load = heap_alloc(sizeof(region_load_t));
-        load->region_index = region_count - 1;
-        load->offset = program_header.offset;
-        load->size = program_header.filesz;
-        loads = heap_realloc(loads, ++load_count * sizeof(region_load_t *));
-        loads[load_count - 1] = load;
+        loads[load_count].region_index = region_count - 1;
+        loads[load_count].offset = program_header->offset;
+        loads[load_count].size = program_header->filesz;
+        load_count++;
     }
+    heap_free(program_headers);
 
+    // Place the image in one block unless the holes between regions outweigh the regions themselves
     elf64_xword_t size = highest_vaddr - lowest_vaddr;
-    elf64_xword_t page_count = MATH_DIV_CEIL(size, PMM_GRANULARITY);
-    void *paddr = pmm_alloc(PMM_AREA_STANDARD, page_count);
+    elf64_xword_t total_size = 0;
+    for(size_t i = 0; i < region_count; i++) total_size += regions[i]->aligned_size;
+
+    bool sparse = size > total_size * SPARSE_SPAN_FACTOR;
+    uint64_t block = 0;
+    if(sparse) {
+        log(LOG_LEVEL_DEBUG, "elf: placing %lu regions sparsely (span %#llx, total %#llx)", region_count, size, total_size);
+    } else {
+        // A block congruent to the image modulo the largest region alignment keeps every region congruent
+        size_t alignment = PMM_GRANULARITY;
+        for(size_t i = 0; i < region_count; i++) {
+            if(regions[i]->alignment > alignment) alignment = regions[i]->alignment;
+        }
+        block = alloc_congruent(lowest_vaddr, size, alignment);
+    }
+
     for(size_t i = 0; i < region_count; i++) {
-        void *addr = paddr + (regions[i]->aligned_vaddr - lowest_vaddr);
-        memset(addr, 0, regions[i]->aligned_size);
+        if(sparse) {
+            regions[i]->paddr = alloc_congruent(regions[i]->aligned_vaddr, regions[i]->aligned_size, regions[i]->alignment);
+        } else {
+            regions[i]->paddr = block + (regions[i]->aligned_vaddr - lowest_vaddr);
+        }
 
         arch_ptm_map(
             address_space,
-            (uintptr_t) addr,
+            regions[i]->paddr,
             regions[i]->aligned_vaddr,
             regions[i]->aligned_size,
             (regions[i]->read ? PTM_FLAG_READ : 0) | (regions[i]->write ? PTM_FLAG_WRITE : 0) | (regions[i]->execute ? PTM_FLAG_EXEC : 0)
         );
     }
 
+    // Stream the segments in file order, only the page slack and the BSS are never written by the read
+    sort_loads(loads, load_count);
     for(size_t i = 0; i < load_count; i++) {
-        void *addr = paddr + (regions[loads[i]->region_index]->real_vaddr - lowest_vaddr);
-
-        if(file->ops->read(file, addr, loads[i]->offset, loads[i]->size) != loads[i]->size) {
-            pmm_free(paddr, page_count);
-            log(LOG_LEVEL_WARN, "elf: unable to load program segment %u", loads[i]->region_index);
+        elf_region_t *region = regions[loads[i].region_index];
+        void *region_addr = (void *) (uintptr_t) region->paddr;
+        size_t head = region->real_vaddr - region->aligned_vaddr;
+
+        memset(region_addr, 0, head);
+        if(file->ops->read(file, region_addr + head, loads[i].offset, loads[i].size) != loads[i].size) {
+            if(sparse) {
+                for(size_t j = 0; j < region_count; j++) pmm_free((void *) (uintptr_t) regions[j]->paddr, regions[j]->aligned_size / PMM_GRANULARITY);
+            } else {
+                pmm_free((void *) (uintptr_t) block, size / PMM_GRANULARITY);
+            }
+            log(LOG_LEVEL_WARN, "elf: unable to load program segment %u", loads[i].region_index);
             return NULL;
         }
-
-        heap_free(loads[i]);
+        memset(region_addr + head + loads[i].size, 0, region->aligned_size - head - loads[i].size);
     }
-    if(loads != NULL) heap_free(loads);
+    heap_free(loads);
 
     elf_loaded_image_t *image = heap_alloc(sizeof(elf_loaded_image_t));
-    image->paddr = (uintptr_t) paddr;
     image->aligned_vaddr = lowest_vaddr;
     image->aligned_size = size;
     image->entry = header.entry;
@@ -10,6 +10,11 @@ typedef struct {
     uint64_t aligned_vaddr;
     size_t aligned_size;
 
+    /// Regions are not necessarily placed contiguously in physical memory
+    uint64_t paddr;
+    /// `paddr` is congruent to `aligned_vaddr` modulo this, so large regions can be mapped with huge pages
+    size_t alignment;
+
     bool read    : 1;
     bool write   : 1;
     bool execute : 1;
@@ -19,7 +24,6 @@ typedef struct {
     uint64_t aligned_vaddr;
     size_t aligned_size;
 
-    uint64_t paddr;
     uint64_t entry;
 
     size_t count;
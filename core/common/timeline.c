@@ -0,0 +1,45 @@
+#include "timeline.h"
+
+#include "common/log.h"
+
+#include <stddef.h>
+
+#ifdef __ARCH_X86_64
+#include "arch/x86_64/tsc.h"
+#endif
+
+uint64_t g_timeline[TIMELINE_STAGE_COUNT];
+
+static const char *stage_stringify(timeline_stage_t stage) {
+    switch(stage) {
+        case TIMELINE_STAGE_FIRMWARE_ENTRY:    return "firmware entry";
+        case TIMELINE_STAGE_MEMORY_MAP:        return "memory map";
+        case TIMELINE_STAGE_DISKS:             return "disks";
+        case TIMELINE_STAGE_CONFIG:            return "config";
+        case TIMELINE_STAGE_FRAMEBUFFER:       return "framebuffer";
+        case TIMELINE_STAGE_KERNEL:            return "kernel";
+        case TIMELINE_STAGE_MODULES:           return "modules";
+        case TIMELINE_STAGE_BOOTSERVICES_EXIT: return "bootservices exit";
+        case TIMELINE_STAGE_SMP:               return "smp";
+        case TIMELINE_STAGE_HANDOFF:           return "handoff";
+        case TIMELINE_STAGE_COUNT:             break;
+    }
+    return "unknown";
+}
+
+void timeline_mark(timeline_stage_t stage) {
+#ifdef __ARCH_X86_64
+    g_timeline[stage] = x86_64_tsc_read();
+#else
+#error Unimplemented
+#endif
+}
+
+void timeline_log() {
+    uint64_t previous = g_timeline[TIMELINE_STAGE_FIRMWARE_ENTRY];
+    for(size_t i = 0; i < TIMELINE_STAGE_COUNT; i++) {
+        if(g_timeline[i] == 0) continue;
+        log(LOG_LEVEL_DEBUG, "timeline[%s] = %llu (+%llu)", stage_stringify(i), g_timeline[i], g_timeline[i] - previous);
+        previous = g_timeline[i];
+    }
+}
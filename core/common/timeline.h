@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef enum {
+    TIMELINE_STAGE_FIRMWARE_ENTRY,
+    TIMELINE_STAGE_MEMORY_MAP,
+    TIMELINE_STAGE_DISKS,
+    TIMELINE_STAGE_CONFIG,
+    TIMELINE_STAGE_FRAMEBUFFER,
+    TIMELINE_STAGE_KERNEL,
+    TIMELINE_STAGE_MODULES,
+    TIMELINE_STAGE_BOOTSERVICES_EXIT,
+    TIMELINE_STAGE_SMP,
+    TIMELINE_STAGE_HANDOFF,
+    TIMELINE_STAGE_COUNT
+} timeline_stage_t;
+
+/// Timestamp of every stage, zero if the stage was never reached.
+extern uint64_t g_timeline[TIMELINE_STAGE_COUNT];
+
+void timeline_mark(timeline_stage_t stage);
+void timeline_log();
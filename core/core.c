@@ -4,6 +4,7 @@
 #include "common/config.h"
 #include "common/log.h"
 #include "common/panic.h"
+#include "common/timeline.h"
 #include "dev/disk.h"
 #include "fs/fat.h"
 #include "fs/vfs.h"
@@ -27,6 +28,7 @@
 
     for(size_t i = 0; i < g_pmm_map_size; i++) log(LOG_LEVEL_DEBUG, "pmm_map[%lu] = { base: %#llx, length: %#llx, type: %u }", i, g_pmm_map[i].base, g_pmm_map[i].length, g_pmm_map[i].type);
     log(LOG_LEVEL_INFO, "Loaded physical memory map (%lu entries)", g_pmm_map_size);
+    timeline_mark(TIMELINE_STAGE_MEMORY_MAP);
 
 #ifdef __ARCH_X86_64
     g_smp_reserved_init_page = pmm_alloc(PMM_AREA_LOWMEM, 1);
@@ -37,6 +39,7 @@
     int disk_count = 0;
     for(disk_t *disk = g_disks; disk != NULL; disk = disk->next) disk_count++;
     log(LOG_LEVEL_INFO, "Initialized %i disks", disk_count);
+    timeline_mark(TIMELINE_STAGE_DISKS);
 
     // Load config
     vfs_node_t *config_node = NULL;
@@ -52,6 +55,7 @@
     if(config_node == NULL) panic("could not locate a config file");
     config_t *config = config_parse(config_node);
     log(LOG_LEVEL_INFO, "Config loaded (%u:%u)", config_node->vfs->partition->disk->id, config_node->vfs->partition->id);
+    timeline_mark(TIMELINE_STAGE_CONFIG);
 
     // Find kernel
     const char *kernel_path = config_find_string(config, "kernel", NULL);
@@ -74,6 +78,7 @@
         } else {
             log(LOG_LEVEL_WARN, "Failed to acquire framebuffer");
         }
+        timeline_mark(TIMELINE_STAGE_FRAMEBUFFER);
     }
 
     const char *protocol_name = config_find_string(config, "protocol", NULL);
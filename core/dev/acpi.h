@@ -30,4 +30,18 @@ typedef struct [[gnu::packed]] {
     uint32_t creator_revision;
 } acpi_sdt_header_t;
 
+typedef enum {
+    ACPI_GAS_SPACE_MEMORY = 0,
+    ACPI_GAS_SPACE_IO = 1
+} acpi_gas_space_t;
+
+/// Generic address structure
+typedef struct [[gnu::packed]] {
+    uint8_t address_space;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} acpi_gas_t;
+
 acpi_sdt_header_t *acpi_find_table(acpi_rsdp_t *rsdp, const char *signature);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "dev/acpi.h"
+
+#include <stdint.h>
+
+typedef struct [[gnu::packed]] {
+    acpi_sdt_header_t sdt_header;
+    uint32_t event_timer_block_id;
+    acpi_gas_t base_address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} hpet_t;
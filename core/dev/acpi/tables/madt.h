@@ -21,6 +21,8 @@ typedef enum {
     MADT_GICC = 11
 } madt_record_types_t;
 
+#define MADT_LAPIC_FLAG_ENABLED (1 << 0)
+
 typedef struct [[gnu::packed]] {
     uint8_t type;
     uint8_t length;
@@ -33,6 +35,14 @@ typedef struct [[gnu::packed]] {
     uint32_t flags;
 } madt_record_lapic_t;
 
+typedef struct [[gnu::packed]] {
+    madt_record_t base;
+    uint16_t rsv0;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t acpi_processor_uid;
+} madt_record_x2apic_t;
+
 typedef struct [[gnu::packed]] {
     madt_record_t base;
     uint16_t rsv0;
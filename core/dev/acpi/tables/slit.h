@@ -0,0 +1,11 @@
+#pragma once
+
+#include "dev/acpi.h"
+
+#include <stdint.h>
+
+typedef struct [[gnu::packed]] {
+    acpi_sdt_header_t sdt_header;
+    uint64_t locality_count;
+    uint8_t entries[];
+} slit_t;
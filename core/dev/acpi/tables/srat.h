@@ -0,0 +1,55 @@
+#pragma once
+
+#include "dev/acpi.h"
+
+#include <stdint.h>
+
+#define SRAT_AFFINITY_FLAG_ENABLED (1 << 0)
+
+typedef struct [[gnu::packed]] {
+    acpi_sdt_header_t sdt_header;
+    uint32_t rsv0;
+    uint64_t rsv1;
+} srat_t;
+
+typedef enum {
+    SRAT_LAPIC_AFFINITY = 0,
+    SRAT_MEMORY_AFFINITY = 1,
+    SRAT_X2APIC_AFFINITY = 2
+} srat_record_types_t;
+
+typedef struct [[gnu::packed]] {
+    uint8_t type;
+    uint8_t length;
+} srat_record_t;
+
+typedef struct [[gnu::packed]] {
+    srat_record_t base;
+    uint8_t proximity_domain_low;
+    uint8_t lapic_id;
+    uint32_t flags;
+    uint8_t lsapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} srat_record_lapic_affinity_t;
+
+typedef struct [[gnu::packed]] {
+    srat_record_t base;
+    uint32_t proximity_domain;
+    uint16_t rsv0;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t rsv1;
+    uint32_t flags;
+    uint64_t rsv2;
+} srat_record_memory_affinity_t;
+
+typedef struct [[gnu::packed]] {
+    srat_record_t base;
+    uint16_t rsv0;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t rsv1;
+} srat_record_x2apic_affinity_t;
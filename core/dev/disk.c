@@ -56,7 +56,7 @@ typedef struct [[gnu::packed]] {
 static void initialize_gpt_partitions(disk_t *disk, gpt_header_t *header) {
     uint32_t array_sectors = MATH_DIV_CEIL(header->partition_array_count * header->partition_entry_size, disk->sector_size);
     uint32_t buf_size = MATH_DIV_CEIL(array_sectors * disk->sector_size, PMM_GRANULARITY);
-    void *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, buf_size);
+    void *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, buf_size);
     if(!arch_disk_read_sector(disk, header->partition_array_lba, array_sectors, buf)) {
         for(uint32_t i = 0; i < header->partition_array_count; i++) {
             gpt_entry_t *entry = (gpt_entry_t *) ((uintptr_t) buf + i * header->partition_entry_size);
@@ -83,7 +83,7 @@ static void initialize_gpt_partitions(disk_t *disk, gpt_header_t *header) {
 
 void disk_initialize_partitions(disk_t *disk) {
     int buf_size = MATH_DIV_CEIL(disk->sector_size, PMM_GRANULARITY);
-    void *buf = pmm_alloc(PMM_AREA_CONVENTIONAL, buf_size);
+    void *buf = pmm_alloc_scratch(PMM_AREA_CONVENTIONAL, buf_size);
 
     if(!arch_disk_read_sector(disk, 0, 1, buf)) {
         mbr_t *mbr = (mbr_t *) ((uintptr_t) buf + 440);
@@ -105,7 +105,7 @@ void disk_read(disk_part_t *part, uint64_t offset, uint64_t count, void *dest) {
     uint64_t sect_count = MATH_DIV_CEIL(sect_offset + count, part->disk->sector_size);
 
     uint64_t buf_size = MATH_DIV_CEIL(part->disk->sector_size * sect_count, PMM_GRANULARITY);
-    void *buf = pmm_alloc(PMM_AREA_STANDARD, buf_size);
+    void *buf = pmm_alloc_scratch(PMM_AREA_STANDARD, buf_size);
 
     if(arch_disk_read_sector(part->disk, part->lba + lba_offset, sect_count, buf)) panic("disk read sector failed");
     memcpy(dest, (void *) (buf + sect_offset), count);
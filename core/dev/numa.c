@@ -0,0 +1,123 @@
+#include "numa.h"
+
+#include "common/log.h"
+#include "dev/acpi/tables/slit.h"
+#include "dev/acpi/tables/srat.h"
+#include "memory/heap.h"
+#include "memory/pmm.h"
+
+numa_topology_t *numa_parse(acpi_rsdp_t *rsdp) {
+    srat_t *srat = (srat_t *) acpi_find_table(rsdp, "SRAT");
+    if(srat == NULL) return NULL;
+
+    // Count first so both arrays are allocated once
+    size_t cpu_count = 0, memory_range_count = 0;
+    for(size_t offset = sizeof(srat_t); offset + sizeof(srat_record_t) <= srat->sdt_header.length;) {
+        srat_record_t *record = (srat_record_t *) ((uintptr_t) srat + offset);
+        if(record->length == 0) break;
+        offset += record->length;
+
+        switch(record->type) {
+            case SRAT_LAPIC_AFFINITY:
+            case SRAT_X2APIC_AFFINITY:  cpu_count++; break;
+            case SRAT_MEMORY_AFFINITY:  memory_range_count++; break;
+        }
+    }
+
+    numa_topology_t *numa = heap_alloc_persistent(sizeof(numa_topology_t));
+    numa->cpu_count = 0;
+    numa->cpus = heap_alloc_persistent(sizeof(numa_cpu_affinity_t) * (cpu_count == 0 ? 1 : cpu_count));
+    numa->memory_range_count = 0;
+    numa->memory_ranges = heap_alloc_persistent(sizeof(numa_memory_range_t) * (memory_range_count == 0 ? 1 : memory_range_count));
+    numa->locality_count = 0;
+    numa->distances = NULL;
+
+    for(size_t offset = sizeof(srat_t); offset + sizeof(srat_record_t) <= srat->sdt_header.length;) {
+        srat_record_t *record = (srat_record_t *) ((uintptr_t) srat + offset);
+        if(record->length == 0) break;
+        offset += record->length;
+
+        switch(record->type) {
+            case SRAT_LAPIC_AFFINITY:
+                if(record->length < sizeof(srat_record_lapic_affinity_t)) continue;
+
+                srat_record_lapic_affinity_t *lapic = (srat_record_lapic_affinity_t *) record;
+                if((lapic->flags & SRAT_AFFINITY_FLAG_ENABLED) == 0) continue;
+
+                numa->cpus[numa->cpu_count].lapic_id = lapic->lapic_id;
+                numa->cpus[numa->cpu_count].domain = lapic->proximity_domain_low | ((uint32_t) lapic->proximity_domain_high[0] << 8) | ((uint32_t) lapic->proximity_domain_high[1] << 16) | ((uint32_t) lapic->proximity_domain_high[2] << 24);
+                numa->cpu_count++;
+                break;
+            case SRAT_X2APIC_AFFINITY:
+                if(record->length < sizeof(srat_record_x2apic_affinity_t)) continue;
+
+                srat_record_x2apic_affinity_t *x2apic = (srat_record_x2apic_affinity_t *) record;
+                if((x2apic->flags & SRAT_AFFINITY_FLAG_ENABLED) == 0) continue;
+
+                numa->cpus[numa->cpu_count].lapic_id = x2apic->x2apic_id;
+                numa->cpus[numa->cpu_count].domain = x2apic->proximity_domain;
+                numa->cpu_count++;
+                break;
+            case SRAT_MEMORY_AFFINITY:
+                if(record->length < sizeof(srat_record_memory_affinity_t)) continue;
+
+                srat_record_memory_affinity_t *memory = (srat_record_memory_affinity_t *) record;
+                if((memory->flags & SRAT_AFFINITY_FLAG_ENABLED) == 0 || memory->length == 0) continue;
+
+                numa->memory_ranges[numa->memory_range_count].base = memory->base_address;
+                numa->memory_ranges[numa->memory_range_count].length = memory->length;
+                numa->memory_ranges[numa->memory_range_count].domain = memory->proximity_domain;
+                numa->memory_range_count++;
+                break;
+        }
+    }
+
+    slit_t *slit = (slit_t *) acpi_find_table(rsdp, "SLIT");
+    if(slit != NULL) {
+        if(sizeof(slit_t) + slit->locality_count * slit->locality_count > slit->sdt_header.length) {
+            log(LOG_LEVEL_WARN, "SLIT is shorter than its locality count (%llu)", slit->locality_count);
+        } else {
+            numa->locality_count = slit->locality_count;
+            numa->distances = (uint8_t *) slit->entries;
+        }
+    }
+
+    log(LOG_LEVEL_INFO, "NUMA topology with %zu cpu affinities, %zu memory ranges and %zu localities", numa->cpu_count, numa->memory_range_count, numa->locality_count);
+    return numa;
+}
+
+uint32_t numa_cpu_domain(numa_topology_t *numa, uint32_t lapic_id) {
+    if(numa == NULL) return NUMA_DOMAIN_NONE;
+    for(size_t i = 0; i < numa->cpu_count; i++) {
+        if(numa->cpus[i].lapic_id == lapic_id) return numa->cpus[i].domain;
+    }
+    return NUMA_DOMAIN_NONE;
+}
+
+uint32_t numa_address_domain(numa_topology_t *numa, uint64_t address) {
+    if(numa == NULL) return NUMA_DOMAIN_NONE;
+    for(size_t i = 0; i < numa->memory_range_count; i++) {
+        numa_memory_range_t *range = &numa->memory_ranges[i];
+        if(address >= range->base && address - range->base < range->length) return range->domain;
+    }
+    return NUMA_DOMAIN_NONE;
+}
+
+void *numa_alloc_persistent(numa_topology_t *numa, uint32_t domain, size_t page_count) {
+    if(numa != NULL && domain != NUMA_DOMAIN_NONE) {
+        for(size_t i = 0; i < numa->memory_range_count; i++) {
+            numa_memory_range_t *range = &numa->memory_ranges[i];
+            if(range->domain != domain) continue;
+
+            // Clamp to standard memory, on BIOS this also keeps the allocation addressable
+            pmm_map_area_t area = {.start = range->base, .end = range->base + range->length};
+            if(area.start < PMM_AREA_STANDARD.start) area.start = PMM_AREA_STANDARD.start;
+            if(area.end > PMM_AREA_STANDARD.end) area.end = PMM_AREA_STANDARD.end;
+            if(area.start >= area.end) continue;
+
+            void *address = pmm_try_alloc_persistent(area, page_count);
+            if(address != NULL) return address;
+        }
+    }
+    return pmm_alloc_persistent(page_count);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "dev/acpi.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMA_DOMAIN_NONE UINT32_MAX
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t domain;
+} numa_memory_range_t;
+
+typedef struct {
+    uint32_t lapic_id;
+    uint32_t domain;
+} numa_cpu_affinity_t;
+
+typedef struct {
+    size_t cpu_count;
+    numa_cpu_affinity_t *cpus;
+
+    size_t memory_range_count;
+    numa_memory_range_t *memory_ranges;
+
+    /// Distance matrix from the SLIT, `locality_count` squared entries. NULL when there is no SLIT
+    size_t locality_count;
+    uint8_t *distances;
+} numa_topology_t;
+
+/// Parse the SRAT and SLIT. Returns NULL when the firmware does not describe any NUMA topology.
+/// The topology is allocated persistent as memory domains are looked up after the scratch heap is released.
+numa_topology_t *numa_parse(acpi_rsdp_t *rsdp);
+
+/// Proximity domain of a CPU by APIC ID, `NUMA_DOMAIN_NONE` if it has no affinity entry.
+uint32_t numa_cpu_domain(numa_topology_t *numa, uint32_t lapic_id);
+
+/// Proximity domain of a physical address, `NUMA_DOMAIN_NONE` if no memory range covers it.
+uint32_t numa_address_domain(numa_topology_t *numa, uint64_t address);
+
+/// Allocate persistent pages from memory in `domain`, falling back to `pmm_alloc_persistent` when the domain has none left.
+void *numa_alloc_persistent(numa_topology_t *numa, uint32_t domain, size_t page_count);
@@ -138,6 +138,10 @@ typedef struct {
     node_type_t type;
     uint32_t cluster;
     uint32_t file_size;
+
+    /// Last cluster read and its index in the chain, sequential reads continue from here instead of walking the chain again
+    uint32_t cursor_cluster;
+    uint32_t cursor_index;
 } node_data_t;
 
 static vfs_node_ops_t g_node_ops;
@@ -175,6 +179,8 @@ static vfs_node_t *create_node(vfs_t *vfs, node_type_t type, uint32_t cluster, u
     node_data->type = type;
     node_data->cluster = cluster;
     node_data->file_size = file_size;
+    node_data->cursor_cluster = 0;
+    node_data->cursor_index = 0;
 
     vfs_node_t *node = heap_alloc(sizeof(vfs_node_t));
     node->vfs = vfs;
@@ -205,24 +211,28 @@ static size_t unicode2_to_ascii(char *dest, const void *src, size_t count) {
     return count;
 }
 
+/// Copy the characters of a long name entry into `lfn`, clamped to `MAX_FILENAME_LENGTH`.
+/// Returns true once the first part of the name is in place and `lfn` holds the complete name.
+static bool lfn_assemble(lfn_directory_entry_t *lfn_entry, char *lfn) {
+    if(DIR_ENTRY_IS_LAST_LONG_NAME(lfn_entry)) memset(lfn, 0, MAX_FILENAME_LENGTH + 1);
+
+    unsigned int index = ((lfn_entry->order & 0x1F) - 1) * 13;
+    if(index >= MAX_FILENAME_LENGTH) return false;
+
+    unsigned int chars_left = MAX_FILENAME_LENGTH - index;
+    chars_left -= unicode2_to_ascii(lfn + index, lfn_entry->name1, math_min(chars_left, 5));
+    if(chars_left == 0) return index == 0;
+    chars_left -= unicode2_to_ascii(lfn + index + 5, lfn_entry->name2, math_min(chars_left, 6));
+    if(chars_left == 0) return index == 0;
+    unicode2_to_ascii(lfn + index + 11, lfn_entry->name3, math_min(chars_left, 2));
+    return index == 0;
+}
+
 static int parse_entry(directory_entry_t *entry, char *lfn, char *name) {
     if(entry->name[0] == 0) return DIR_PARSE_LAST;
     if(DIR_ENTRY_IS_FREE(entry)) return DIR_PARSE_NOT_FOUND;
     if(DIR_ENTRY_IS_LONG_NAME(entry)) {
-        lfn_directory_entry_t *lfn_entry = (lfn_directory_entry_t *) entry;
-        if(DIR_ENTRY_IS_LAST_LONG_NAME(lfn_entry)) memset(lfn, 0, MAX_FILENAME_LENGTH + 1);
-
-        unsigned int index = ((lfn_entry->order & 0x1F) - 1) * 13;
-        unsigned int chars_left = MAX_FILENAME_LENGTH - index;
-
-        if(chars_left <= 0) return DIR_PARSE_NOT_FOUND;
-        chars_left -= unicode2_to_ascii(lfn + index, lfn_entry->name1, math_min(chars_left, 5));
-        if(chars_left <= 0) return DIR_PARSE_NOT_FOUND;
-        chars_left -= unicode2_to_ascii(lfn + index + 5, lfn_entry->name2, math_min(chars_left, 6));
-        if(chars_left <= 0) return DIR_PARSE_NOT_FOUND;
-        chars_left -= unicode2_to_ascii(lfn + index + 11, lfn_entry->name3, math_min(chars_left, 2));
-
-        if(index != 0 || !string_eq(lfn, name)) return DIR_PARSE_NOT_FOUND;
+        if(!lfn_assemble((lfn_directory_entry_t *) entry, lfn) || !string_eq(lfn, name)) return DIR_PARSE_NOT_FOUND;
         return DIR_PARSE_FOUND_NEXT;
     }
     char sfn[11];
@@ -279,14 +289,93 @@ exit2:
     return NULL;
 }
 
+/// Readable `NAME.EXT` form of a short name.
+static void sfn_to_name(directory_entry_t *entry, char *name) {
+    size_t length = 0;
+    for(int i = 0; i < 8 && entry->name[i] != ' '; i++) name[length++] = entry->name[i];
+    if(entry->name[8] != ' ') {
+        name[length++] = '.';
+        for(int i = 8; i < 11 && entry->name[i] != ' '; i++) name[length++] = entry->name[i];
+    }
+    name[length] = '\0';
+}
+
+/// Handle one raw directory entry for readdir. Returns false once the scan should stop.
+static bool readdir_entry(vfs_node_t *node, directory_entry_t *entry, char *lfn, bool *lfn_valid, vfs_readdir_callback_t callback, void *context) {
+    if(entry->name[0] == 0) return false;
+    if(DIR_ENTRY_IS_FREE(entry)) {
+        *lfn_valid = false;
+        return true;
+    }
+
+    if(DIR_ENTRY_IS_LONG_NAME(entry)) {
+        *lfn_valid = lfn_assemble((lfn_directory_entry_t *) entry, lfn);
+        return true;
+    }
+
+    bool has_lfn = *lfn_valid;
+    *lfn_valid = false;
+    if((entry->attributes & DIR_ENTRY_ATTR_VOLUME_ID) != 0 || entry->name[0] == '.') return true;
+
+    char sfn[13];
+    if(!has_lfn) sfn_to_name(entry, sfn);
+
+    uint32_t entry_cluster = entry->cluster_low;
+    if(FS_DATA(node->vfs)->fat_meta.type == FAT_TYPE_32) entry_cluster |= (entry->cluster_high << 16);
+    bool is_directory = DIR_ENTRY_IS_DIRECTORY(entry);
+    vfs_node_t *child = create_node(node->vfs, is_directory ? NODE_TYPE_DIR : NODE_TYPE_FILE, entry_cluster, entry->file_size);
+    return callback(context, has_lfn ? lfn : sfn, child, is_directory);
+}
+
+static bool node_readdir(vfs_node_t *node, vfs_readdir_callback_t callback, void *context) {
+    if(NODE_DATA(node)->type != NODE_TYPE_DIR && NODE_DATA(node)->type != NODE_TYPE_ROOT) return false;
+
+    char lfn[MAX_FILENAME_LENGTH + 1];
+    bool lfn_valid = false;
+    if(NODE_DATA(node)->type == NODE_TYPE_ROOT && (FS_DATA(node->vfs)->fat_meta.type == FAT_TYPE_12 || FS_DATA(node->vfs)->fat_meta.type == FAT_TYPE_16)) {
+        size_t root_size = FS_DATA(node->vfs)->fat_meta.root_dir_entry_count * sizeof(directory_entry_t);
+        directory_entry_t *entries = heap_alloc(root_size);
+        disk_read(FS_DATA(node->vfs)->partition, ROOT_OFFSET(FS_DATA(node->vfs)), root_size, entries);
+        for(uint16_t i = 0; i < FS_DATA(node->vfs)->fat_meta.root_dir_entry_count; i++) {
+            if(!readdir_entry(node, &entries[i], lfn, &lfn_valid, callback, context)) break;
+        }
+        heap_free(entries);
+        return true;
+    }
+
+    directory_entry_t *entries = heap_alloc(FS_DATA(node->vfs)->fat_meta.cluster_size);
+    uint32_t cluster = NODE_DATA(node)->cluster;
+    bool done = false;
+    while(!done && !CLUSTER_IS_END(cluster, FS_DATA(node->vfs)->fat_meta.type)) {
+        if(CLUSTER_IS_BAD(cluster, FS_DATA(node->vfs)->fat_meta.type)) panic("bad FAT cluster");
+        disk_read(FS_DATA(node->vfs)->partition, DATA_OFFSET(FS_DATA(node->vfs)) + (cluster - 2) * FS_DATA(node->vfs)->fat_meta.cluster_size, FS_DATA(node->vfs)->fat_meta.cluster_size, entries);
+        for(unsigned int i = 0; i < FS_DATA(node->vfs)->fat_meta.cluster_size / sizeof(directory_entry_t); i++) {
+            if(!readdir_entry(node, &entries[i], lfn, &lfn_valid, callback, context)) {
+                done = true;
+                break;
+            }
+        }
+        cluster = next_cluster(FS_DATA(node->vfs), cluster);
+    }
+    heap_free(entries);
+    return true;
+}
+
 static size_t node_read(vfs_node_t *node, void *dest, size_t offset, size_t count) {
     if(NODE_DATA(node)->type != NODE_TYPE_FILE) return 0;
+    if(offset >= NODE_DATA(node)->file_size) return 0;
 
     size_t initial_count = count;
     size_t initial_offset = offset;
 
     uint32_t cluster = NODE_DATA(node)->cluster;
-    for(unsigned int i = 0; i < offset / FS_DATA(node->vfs)->fat_meta.cluster_size; i++) {
+    uint32_t index = 0;
+    uint32_t target_index = offset / FS_DATA(node->vfs)->fat_meta.cluster_size;
+    if(NODE_DATA(node)->cursor_cluster != 0 && NODE_DATA(node)->cursor_index <= target_index) {
+        cluster = NODE_DATA(node)->cursor_cluster;
+        index = NODE_DATA(node)->cursor_index;
+    }
+    for(; index < target_index; index++) {
         if(CLUSTER_IS_BAD(cluster, FS_DATA(node->vfs)->fat_meta.type)) panic("bad FAT cluster");
         if(CLUSTER_IS_END(cluster, FS_DATA(node->vfs)->fat_meta.type)) return 0;
         cluster = next_cluster(FS_DATA(node->vfs), cluster);
@@ -302,9 +391,14 @@ static size_t node_read(vfs_node_t *node, void *dest, size_t offset, size_t coun
             cluster = next_cluster(FS_DATA(node->vfs), cluster);
         }
 
+        NODE_DATA(node)->cursor_cluster = streak_start + streak_size - 1;
+        NODE_DATA(node)->cursor_index = index + streak_size - 1;
+        index += streak_size;
+
         size_t read_count = streak_size * FS_DATA(node->vfs)->fat_meta.cluster_size - offset;
         if(read_count > count) read_count = count;
-        if(initial_offset + read_count > NODE_DATA(node)->file_size) read_count = NODE_DATA(node)->file_size - initial_offset;
+        size_t position = initial_offset + (initial_count - count);
+        if(position + read_count > NODE_DATA(node)->file_size) read_count = NODE_DATA(node)->file_size - position;
         disk_read(FS_DATA(node->vfs)->partition, DATA_OFFSET(FS_DATA(node->vfs)) + (streak_start - 2) * FS_DATA(node->vfs)->fat_meta.cluster_size + offset, read_count, dest);
         count -= read_count;
         dest += read_count;
@@ -318,7 +412,7 @@ static size_t node_get_size(vfs_node_t *node) {
     return NODE_DATA(node)->file_size;
 }
 
-static vfs_node_ops_t g_node_ops = {.lookup = node_lookup, .read = node_read, .get_size = node_get_size};
+static vfs_node_ops_t g_node_ops = {.lookup = node_lookup, .readdir = node_readdir, .read = node_read, .get_size = node_get_size};
 
 vfs_t *fat_initialize(disk_part_t *partition) {
     bpb_t *bpb = heap_alloc(sizeof(bpb_t));
@@ -16,8 +16,13 @@ typedef struct vfs_node {
     void *data;
 } vfs_node_t;
 
+/// Called for every directory entry, return false to stop the scan.
+typedef bool (*vfs_readdir_callback_t)(void *context, const char *name, vfs_node_t *node, bool is_directory);
+
 typedef struct vfs_node_ops {
     vfs_node_t *(*lookup)(vfs_node_t *node, char *name);
+    /// Scan a directory once, calling `callback` for each entry in on-disk order. Returns false if the node is not a directory.
+    bool (*readdir)(vfs_node_t *node, vfs_readdir_callback_t callback, void *context);
     size_t (*read)(vfs_node_t *node, void *dest, size_t offset, size_t count);
     size_t (*get_size)(vfs_node_t *node);
 } vfs_node_ops_t;
@@ -1,5 +1,6 @@
 #include "heap.h"
 
+#include "common/log.h"
 #include "common/panic.h"
 #include "lib/math.h"
 #include "lib/mem.h"
@@ -7,82 +8,208 @@
 
 #include <stdint.h>
 
-#define MINIMUM_ENTRY_SIZE 8
-#define EXTRA_ALLOC_PAGES 2
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 10
+#define SLAB_CLASS_COUNT (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_CLASS_LARGE UINT16_MAX
+
+#define OBJECT_ALIGNMENT 16
+
+typedef enum : uint8_t {
+    ZONE_SCRATCH,
+    ZONE_PERSISTENT,
+    ZONE_COUNT
+} zone_t;
+
+/// Header at the base of every heap page run, shared by slabs and large objects.
+typedef struct slab {
+    uint16_t class_index;
+    zone_t zone;
+    uint8_t rsv0;
+    uint32_t in_use;
+    union {
+        struct {
+            struct slab_object *free_list;
+            struct slab *next, *prev;
+        };
+        size_t page_count;
+    };
+} slab_t;
+
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object_t;
+
+#define SLAB_HEADER_SIZE MATH_CEIL(sizeof(slab_t), OBJECT_ALIGNMENT)
+
+static slab_t *g_partial_slabs[ZONE_COUNT][SLAB_CLASS_COUNT] = {};
+
+static struct {
+    size_t used_bytes, peak_used_bytes;
+    size_t held_pages, peak_held_pages;
+} g_stats[ZONE_COUNT] = {};
+
+static void stats_update(zone_t zone, ptrdiff_t used_bytes, ptrdiff_t held_pages) {
+    g_stats[zone].used_bytes += used_bytes;
+    g_stats[zone].held_pages += held_pages;
+    if(g_stats[zone].used_bytes > g_stats[zone].peak_used_bytes) g_stats[zone].peak_used_bytes = g_stats[zone].used_bytes;
+    if(g_stats[zone].held_pages > g_stats[zone].peak_held_pages) g_stats[zone].peak_held_pages = g_stats[zone].held_pages;
+}
 
-typedef struct heap_entry {
-    size_t size;
-    struct heap_entry *next, *last;
-} heap_entry_t;
+static void *zone_pages_alloc(zone_t zone, size_t page_count) {
+    if(zone == ZONE_PERSISTENT) return pmm_alloc_persistent(page_count);
+    return pmm_alloc_scratch(PMM_AREA_STANDARD, page_count);
+}
 
-heap_entry_t *g_heap = NULL;
+static size_t class_size(uint32_t class_index) {
+    return (size_t) 1 << (class_index + SLAB_MIN_SHIFT);
+}
 
-static void delete(heap_entry_t *entry) {
-    if(g_heap == entry) g_heap = entry->next;
-    if(entry->last != NULL) entry->last->next = entry->next;
-    if(entry->next != NULL) entry->next->last = entry->last;
-    entry->next = NULL;
-    entry->last = NULL;
+static uint32_t class_of(size_t size) {
+    uint32_t class_index = 0;
+    while(class_size(class_index) < size) class_index++;
+    return class_index;
 }
 
-static void insert(heap_entry_t *entry) {
-    entry->last = NULL;
-    entry->next = g_heap;
-    if(g_heap != NULL) g_heap->last = entry;
-    g_heap = entry;
+static slab_t *slab_of(void *address) {
+    return (slab_t *) ((uintptr_t) address & ~(uintptr_t) (PMM_GRANULARITY - 1));
 }
 
-static void alloc(int pages) {
-    heap_entry_t *new_entry = pmm_alloc(PMM_AREA_STANDARD, pages);
-    new_entry->size = pages * PMM_GRANULARITY - sizeof(heap_entry_t);
-    insert(new_entry);
+static void partial_insert(slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = g_partial_slabs[slab->zone][slab->class_index];
+    if(slab->next != NULL) slab->next->prev = slab;
+    g_partial_slabs[slab->zone][slab->class_index] = slab;
 }
 
-void *heap_alloc(size_t size) {
-    size = MATH_CEIL(size, 8);
+static void partial_delete(slab_t *slab) {
+    if(g_partial_slabs[slab->zone][slab->class_index] == slab) g_partial_slabs[slab->zone][slab->class_index] = slab->next;
+    if(slab->prev != NULL) slab->prev->next = slab->next;
+    if(slab->next != NULL) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
 
-    for(heap_entry_t *current_entry = g_heap; current_entry != NULL; current_entry = current_entry->next) {
-        if(current_entry->size < size) continue;
+static slab_t *slab_create(zone_t zone, uint32_t class_index) {
+    slab_t *slab = zone_pages_alloc(zone, 1);
+    slab->class_index = class_index;
+    slab->zone = zone;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    size_t size = class_size(class_index);
+    for(uintptr_t object = (uintptr_t) slab + PMM_GRANULARITY - size; object >= (uintptr_t) slab + SLAB_HEADER_SIZE; object -= size) {
+        ((slab_object_t *) object)->next = slab->free_list;
+        slab->free_list = (slab_object_t *) object;
+    }
 
-        size_t left = current_entry->size - size;
-        if(left >= sizeof(heap_entry_t) + MINIMUM_ENTRY_SIZE) {
-            current_entry->size = size;
+    partial_insert(slab);
+    stats_update(zone, 0, 1);
+    return slab;
+}
 
-            heap_entry_t *new_entry = (heap_entry_t *) ((uintptr_t) current_entry + sizeof(heap_entry_t) + current_entry->size);
-            new_entry->size = left - sizeof(heap_entry_t);
-            insert(new_entry);
-        }
+static void *large_alloc(zone_t zone, size_t size) {
+    size_t page_count = MATH_DIV_CEIL(size + SLAB_HEADER_SIZE, PMM_GRANULARITY);
+    slab_t *header = zone_pages_alloc(zone, page_count);
+    header->class_index = SLAB_CLASS_LARGE;
+    header->zone = zone;
+    header->in_use = 1;
+    header->page_count = page_count;
+    stats_update(zone, page_count * PMM_GRANULARITY, page_count);
+    return (void *) ((uintptr_t) header + SLAB_HEADER_SIZE);
+}
 
-        delete(current_entry);
-        return (void *) ((uintptr_t) current_entry + sizeof(heap_entry_t));
-    }
-    alloc(MATH_DIV_CEIL(size + sizeof(heap_entry_t), PMM_GRANULARITY) + EXTRA_ALLOC_PAGES);
-    return heap_alloc(size);
+static void *zone_alloc(zone_t zone, size_t size) {
+    if(size > class_size(SLAB_CLASS_COUNT - 1)) return large_alloc(zone, size);
+
+    uint32_t class_index = class_of(size);
+    slab_t *slab = g_partial_slabs[zone][class_index];
+    if(slab == NULL) slab = slab_create(zone, class_index);
+
+    slab_object_t *object = slab->free_list;
+    slab->free_list = object->next;
+    slab->in_use++;
+    if(slab->free_list == NULL) partial_delete(slab);
+
+    stats_update(zone, class_size(class_index), 0);
+    return object;
+}
+
+void *heap_alloc(size_t size) {
+    return zone_alloc(ZONE_SCRATCH, size);
+}
+
+void *heap_alloc_persistent(size_t size) {
+    return zone_alloc(ZONE_PERSISTENT, size);
 }
 
 void *heap_realloc(void *ptr, size_t new_size) {
-    void *new_ptr = heap_alloc(new_size);
-    if(ptr == NULL) return new_ptr;
-    heap_entry_t *entry = (heap_entry_t *) ((uintptr_t) ptr - sizeof(heap_entry_t));
-    memcpy(new_ptr, ptr, new_size > entry->size ? entry->size : new_size);
+    if(ptr == NULL) return heap_alloc(new_size);
+
+    slab_t *slab = slab_of(ptr);
+    size_t capacity;
+    if(slab->class_index == SLAB_CLASS_LARGE) {
+        capacity = slab->page_count * PMM_GRANULARITY - SLAB_HEADER_SIZE;
+        if(new_size <= capacity) return ptr;
+
+        // Grow in place when the pages directly after the object are free
+        size_t extra_pages = MATH_DIV_CEIL(new_size + SLAB_HEADER_SIZE, PMM_GRANULARITY) - slab->page_count;
+        if(pmm_alloc_at((uintptr_t) slab + slab->page_count * PMM_GRANULARITY, extra_pages, slab->zone == ZONE_PERSISTENT ? PMM_MAP_TYPE_ALLOCATED : PMM_MAP_TYPE_SCRATCH)) {
+            slab->page_count += extra_pages;
+            stats_update(slab->zone, extra_pages * PMM_GRANULARITY, extra_pages);
+            return ptr;
+        }
+    } else {
+        capacity = class_size(slab->class_index);
+        if(new_size <= capacity) return ptr;
+    }
+
+    void *new_ptr = zone_alloc(slab->zone, new_size);
+    memcpy(new_ptr, ptr, capacity);
     heap_free(ptr);
     return new_ptr;
 }
 
 void heap_free(void *address) {
-    heap_entry_t *entry = (heap_entry_t *) ((uintptr_t) address - sizeof(heap_entry_t));
-    for(heap_entry_t *current_entry = g_heap; current_entry != NULL; current_entry = current_entry->next) {
-        if((uintptr_t) current_entry + sizeof(heap_entry_t) + current_entry->size == (uintptr_t) entry) {
-            delete(current_entry);
-            current_entry->size += entry->size + sizeof(heap_entry_t);
-            entry = current_entry;
-            continue;
-        }
+    if(address == NULL) return;
 
-        if((uintptr_t) entry + sizeof(heap_entry_t) + entry->size == (uintptr_t) current_entry) {
-            delete(current_entry);
-            entry->size += current_entry->size + sizeof(heap_entry_t);
-        }
+    slab_t *slab = slab_of(address);
+    if(slab->class_index == SLAB_CLASS_LARGE) {
+        stats_update(slab->zone, -(ptrdiff_t) (slab->page_count * PMM_GRANULARITY), -(ptrdiff_t) slab->page_count);
+        pmm_free(slab, slab->page_count);
+        return;
+    }
+    if(slab->class_index >= SLAB_CLASS_COUNT || slab->zone >= ZONE_COUNT || slab->in_use == 0) panic("heap: invalid free of %#lx", (uintptr_t) address);
+
+    bool was_full = slab->free_list == NULL;
+    ((slab_object_t *) address)->next = slab->free_list;
+    slab->free_list = address;
+    slab->in_use--;
+    stats_update(slab->zone, -(ptrdiff_t) class_size(slab->class_index), 0);
+
+    if(was_full) partial_insert(slab);
+
+    // Keep one empty slab per class around so alternating alloc/free does not thrash the PMM
+    if(slab->in_use == 0 && (g_partial_slabs[slab->zone][slab->class_index] != slab || slab->next != NULL)) {
+        partial_delete(slab);
+        stats_update(slab->zone, 0, -1);
+        pmm_free(slab, 1);
+    }
+}
+
+void heap_release_scratch() {
+    for(size_t i = 0; i < SLAB_CLASS_COUNT; i++) g_partial_slabs[ZONE_SCRATCH][i] = NULL;
+    g_stats[ZONE_SCRATCH].used_bytes = 0;
+    g_stats[ZONE_SCRATCH].held_pages = 0;
+    pmm_release_scratch();
+}
+
+void heap_stats_log() {
+    static const char *zone_names[ZONE_COUNT] = {"scratch", "persistent"};
+    for(size_t i = 0; i < ZONE_COUNT; i++) {
+        size_t held_bytes = g_stats[i].held_pages * PMM_GRANULARITY;
+        size_t fragmentation = held_bytes == 0 ? 0 : (held_bytes - g_stats[i].used_bytes) * 100 / held_bytes;
+        log(LOG_LEVEL_DEBUG, "heap[%s]: %zu bytes in use of %zu pages held (%zu%% fragmentation)", zone_names[i], g_stats[i].used_bytes, g_stats[i].held_pages, fragmentation);
+        log(LOG_LEVEL_DEBUG, "heap[%s]: high-water mark of %zu bytes in use and %zu pages held", zone_names[i], g_stats[i].peak_used_bytes, g_stats[i].peak_held_pages);
     }
-    insert(entry);
 }
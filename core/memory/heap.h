@@ -2,6 +2,17 @@
 
 #include <stddef.h>
 
+/// Allocate memory that is only needed until handoff.
 void *heap_alloc(size_t size);
+
+/// Allocate memory that is handed to the kernel and has to survive handoff.
+void *heap_alloc_persistent(size_t size);
+
 void *heap_realloc(void *ptr, size_t size);
-void heap_free(void *address);
\ No newline at end of file
+void heap_free(void *address);
+
+/// Drop every scratch allocation at once, no scratch pointer may be used afterwards.
+void heap_release_scratch();
+
+/// Log heap usage, high-water mark and fragmentation.
+void heap_stats_log();
\ No newline at end of file
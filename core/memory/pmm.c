@@ -3,120 +3,152 @@
 #include "common/log.h"
 #include "common/panic.h"
 #include "lib/math.h"
+#include "lib/mem.h"
 
 #define SANITIZE_TYPE(TYPE) ((TYPE) == PMM_MAP_TYPE_FREE || (TYPE) == PMM_MAP_TYPE_ALLOCATED || (TYPE) == PMM_MAP_TYPE_EFI_RECLAIMABLE || (TYPE) == PMM_MAP_TYPE_ACPI_RECLAIMABLE)
 
+// Entries kept free so that growing the map can itself modify the map
+#define MAP_GROW_SLACK 8
+
+// Entries `pmm_map_set` reserves for a range inside a single entry, reserved up front by callers that pick an address
+// so the map never grows onto the range they are about to mark
+#define MAP_CLAIM_ENTRIES 5
+
+// Small allocations are served from chunks claimed from the map in one go
+#define CACHE_COUNT 4
+#define CACHE_CHUNK_PAGES 512
+#define CACHE_MAX_RUN 16
+
+typedef struct {
+    pmm_map_area_t area;
+    pmm_map_type_t type;
+    bool top_down;
+    uint64_t base;
+    size_t page_count;
+    size_t hint;
+    uint64_t bitmap[CACHE_CHUNK_PAGES / 64];
+} page_cache_t;
+
+static pmm_map_entry_t g_initial_map[PMM_MAP_INITIAL_CAPACITY];
+static size_t g_map_capacity = PMM_MAP_INITIAL_CAPACITY;
+static bool g_map_growing = false;
+
+static page_cache_t g_caches[CACHE_COUNT];
+
 size_t g_pmm_map_size;
-pmm_map_entry_t g_pmm_map[PMM_MAP_MAX_ENTRIES];
+pmm_map_entry_t *g_pmm_map = g_initial_map;
 
-static void map_insert(int index, pmm_map_entry_t entry) {
-    if(g_pmm_map_size == PMM_MAP_MAX_ENTRIES) panic("memory map overflow");
-    for(int i = g_pmm_map_size; i > index; i--) g_pmm_map[i] = g_pmm_map[i - 1];
-    g_pmm_map[index] = entry;
-    g_pmm_map_size++;
+/// Binary search for the first entry that ends past `address`.
+static size_t map_search(uint64_t address) {
+    size_t low = 0, high = g_pmm_map_size;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        if(g_pmm_map[middle].base + g_pmm_map[middle].length <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
 }
 
-static void map_delete(size_t index) {
-    for(size_t i = index; i < g_pmm_map_size - 1; i++) g_pmm_map[i] = g_pmm_map[i + 1];
-    g_pmm_map_size--;
-}
+static uint64_t map_claim(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type, bool top_down);
 
-void pmm_map_set(uint64_t base, uint64_t length, pmm_map_type_t type, bool force) {
-    for(size_t i = 0; i < g_pmm_map_size; i++) {
-        pmm_map_entry_t *map_entry = &g_pmm_map[i];
+/// Ensure `extra` entries can be inserted, moving the map into a larger allocation if necessary.
+static void map_reserve(size_t extra) {
+    if(g_map_growing || g_pmm_map_size + extra + MAP_GROW_SLACK <= g_map_capacity) return;
+    g_map_growing = true;
 
-        bool override = type > map_entry->type || force;
-        bool overlap_start = false, overlap_end = false;
-        if(base > map_entry->base && base < map_entry->base + map_entry->length) overlap_start = true;
-        if(base + length > map_entry->base && base + length < map_entry->base + map_entry->length) overlap_end = true;
+    size_t capacity = g_map_capacity * 2;
+    while(capacity < g_pmm_map_size + extra + MAP_GROW_SLACK) capacity *= 2;
+    size_t page_count = MATH_DIV_CEIL(capacity * sizeof(pmm_map_entry_t), PMM_GRANULARITY);
 
-        // Map entry falls over the entry
-        if(overlap_start && overlap_end) {
-            if(!override) return;
+    pmm_map_entry_t *map = (pmm_map_entry_t *) (uintptr_t) map_claim(PMM_AREA_STANDARD, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED, true);
+    if(map == NULL) panic("memory map overflow");
+    memcpy(map, g_pmm_map, sizeof(pmm_map_entry_t) * g_pmm_map_size);
 
-            size_t start_base = map_entry->base;
-            size_t start_length = base - start_base;
+    pmm_map_entry_t *old_map = g_pmm_map;
+    size_t old_capacity = g_map_capacity;
+    g_pmm_map = map;
+    g_map_capacity = (page_count * PMM_GRANULARITY) / sizeof(pmm_map_entry_t);
+    if(old_map != g_initial_map) pmm_map_set((uintptr_t) old_map, MATH_DIV_CEIL(old_capacity * sizeof(pmm_map_entry_t), PMM_GRANULARITY) * PMM_GRANULARITY, PMM_MAP_TYPE_FREE, true);
 
-            size_t end_base = base + length;
-            size_t end_length = (map_entry->base + map_entry->length) - end_base;
+    g_map_growing = false;
+}
 
-            map_entry->base = start_base;
-            map_entry->length = start_length;
-            pmm_map_set(end_base, end_length, map_entry->type, true);
+static void map_insert(size_t index, pmm_map_entry_t entry) {
+    if(g_pmm_map_size == g_map_capacity) panic("memory map overflow");
+    memmove(&g_pmm_map[index + 1], &g_pmm_map[index], sizeof(pmm_map_entry_t) * (g_pmm_map_size - index));
+    g_pmm_map[index] = entry;
+    g_pmm_map_size++;
+}
+
+/// Merge adjacent entries of the same type within [from, to).
+static void map_coalesce(size_t from, size_t to) {
+    if(to > g_pmm_map_size) to = g_pmm_map_size;
+    if(from >= to) return;
+
+    size_t write = from;
+    for(size_t read = from + 1; read < to; read++) {
+        pmm_map_entry_t *entry = &g_pmm_map[write];
+        if(entry->type == g_pmm_map[read].type && entry->base + entry->length == g_pmm_map[read].base) {
+            entry->length += g_pmm_map[read].length;
             continue;
         }
+        g_pmm_map[++write] = g_pmm_map[read];
+    }
 
-        // Start of entry overlaps with map entry
-        if(overlap_start) {
-            size_t amount = (map_entry->base + map_entry->length) - base;
-            if(override) {
-                map_entry->length -= amount;
-                if(map_entry->length == 0) {
-                    map_delete(i);
-                    --i;
-                }
-            } else {
-                length -= amount;
-                base += amount;
-            }
-        }
+    size_t removed = to - (write + 1);
+    if(removed == 0) return;
+    memmove(&g_pmm_map[write + 1], &g_pmm_map[to], sizeof(pmm_map_entry_t) * (g_pmm_map_size - to));
+    g_pmm_map_size -= removed;
+}
 
-        // End of entry overlaps with map entry
-        if(overlap_end) {
-            size_t amount = (base + length) - map_entry->base;
-            if(override) {
-                map_entry->length -= amount;
-                map_entry->base += amount;
-                if(map_entry->length == 0) {
-                    map_delete(i);
-                    --i;
-                }
-            } else {
-                length -= amount;
-            }
-        }
+void pmm_map_set(uint64_t base, uint64_t length, pmm_map_type_t type, bool force) {
+    if(length == 0) return;
+    uint64_t end = base + length;
 
-        // Entry falls over map entry
-        if(base < map_entry->base && base + length > map_entry->base + map_entry->length) {
-            if(override) {
-                map_delete(i);
-                --i;
-                continue;
-            }
+    size_t first = map_search(base);
+    size_t overlap_count = 0;
+    while(first + overlap_count < g_pmm_map_size && g_pmm_map[first + overlap_count].base < end) overlap_count++;
 
-            size_t start_base = base;
-            size_t start_length = map_entry->base - start_base;
+    // Every overlapped entry can be split in three, plus the gaps around them
+    map_reserve(2 * overlap_count + 3);
+    first = map_search(base);
 
-            size_t end_base = map_entry->base + map_entry->length;
-            size_t end_length = (base + length) - end_base;
+    size_t i = first;
+    uint64_t cursor = base;
+    while(cursor < end) {
+        if(i == g_pmm_map_size || g_pmm_map[i].base >= end) {
+            map_insert(i++, (pmm_map_entry_t) {.base = cursor, .length = end - cursor, .type = type});
+            break;
+        }
 
-            pmm_map_set(start_base, start_length, type, force);
-            pmm_map_set(end_base, end_length, type, force);
-            return;
+        if(cursor < g_pmm_map[i].base) {
+            map_insert(i, (pmm_map_entry_t) {.base = cursor, .length = g_pmm_map[i].base - cursor, .type = type});
+            cursor = g_pmm_map[++i].base;
         }
 
-        // Entry equals map entry
-        if(base == map_entry->base && length == map_entry->length) {
-            if(!override) return;
-            map_delete(i);
-            --i;
+        pmm_map_entry_t entry = g_pmm_map[i];
+        uint64_t entry_end = entry.base + entry.length;
+        uint64_t overlap_end = entry_end < end ? entry_end : end;
+
+        if(entry.type != type && (type > entry.type || force)) {
+            if(cursor > entry.base) {
+                g_pmm_map[i].length = cursor - entry.base;
+                map_insert(++i, (pmm_map_entry_t) {.base = cursor, .length = overlap_end - cursor, .type = type});
+            } else {
+                g_pmm_map[i].length = overlap_end - cursor;
+                g_pmm_map[i].type = type;
+            }
+            if(overlap_end < entry_end) map_insert(++i, (pmm_map_entry_t) {.base = overlap_end, .length = entry_end - overlap_end, .type = entry.type});
         }
-    }
-    if(length == 0) return;
 
-    size_t i = 0;
-    for(; i < g_pmm_map_size && g_pmm_map[i].base <= base; i++);
-    if(i != 0 && g_pmm_map[i - 1].type == type && g_pmm_map[i - 1].base + g_pmm_map[i - 1].length == base) {
-        g_pmm_map[i - 1].length += length;
-        return;
-    }
-    if(g_pmm_map[i].type == type && g_pmm_map[i].base == base + length) {
-        g_pmm_map[i].base = base;
-        g_pmm_map[i].length += length;
-        return;
+        cursor = overlap_end;
+        i++;
     }
 
-    map_insert(i, (pmm_map_entry_t) {.base = base, .length = length, .type = type});
+    map_coalesce(first == 0 ? 0 : first - 1, i + 1);
 }
 
 void pmm_map_add(uint64_t base, uint64_t length, pmm_map_type_t type) {
@@ -138,42 +170,220 @@ void pmm_map_add(uint64_t base, uint64_t length, pmm_map_type_t type) {
     pmm_map_set(base, length, type, false);
 }
 
-bool pmm_alloc_at(uint64_t address, size_t page_count, pmm_map_type_t type) {
+static uint64_t map_claim(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type, bool top_down) {
+    map_reserve(MAP_CLAIM_ENTRIES);
+
     size_t length = page_count * PMM_GRANULARITY;
-    for(size_t i = 0; i < g_pmm_map_size; i++) {
-        if(g_pmm_map[i].type != PMM_MAP_TYPE_FREE) continue;
-        if(g_pmm_map[i].base > address || g_pmm_map[i].base + g_pmm_map[i].length < address + length) continue;
+    if(top_down) {
+        for(size_t i = g_pmm_map_size; i > 0; i--) {
+            if(g_pmm_map[i - 1].type != PMM_MAP_TYPE_FREE) continue;
 
-        pmm_map_set(address, length, type, true);
-        return true;
+            uint64_t low = g_pmm_map[i - 1].base < area.start ? area.start : g_pmm_map[i - 1].base;
+            uint64_t high = g_pmm_map[i - 1].base + g_pmm_map[i - 1].length > area.end ? area.end : g_pmm_map[i - 1].base + g_pmm_map[i - 1].length;
+            if(high <= low || high - low < length) continue;
+
+            uint64_t ue_base = MATH_FLOOR(high - length, alignment);
+            if(ue_base < low) continue; // claim does not fit inside entry once aligned
+
+            pmm_map_set(ue_base, length, type, true);
+            return ue_base;
+        }
+        return 0;
     }
-    return false;
-}
 
-void *pmm_alloc_ext(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type) {
-    size_t length = page_count * PMM_GRANULARITY;
     for(size_t i = 0; i < g_pmm_map_size; i++) {
         if(g_pmm_map[i].type != PMM_MAP_TYPE_FREE) continue;
         if(g_pmm_map[i].base + g_pmm_map[i].length <= area.start || g_pmm_map[i].base >= area.end) continue;
 
-        uint64_t ue_base = MATH_CEIL(g_pmm_map[i].base, alignment);
-        if(ue_base >= g_pmm_map[i].base + g_pmm_map[i].length) continue;
-        if(g_pmm_map[i].base < area.start) ue_base = area.start;
+        uint64_t ue_base = MATH_CEIL(g_pmm_map[i].base < area.start ? area.start : g_pmm_map[i].base, alignment);
+        if(ue_base >= g_pmm_map[i].base + g_pmm_map[i].length || ue_base >= area.end) continue;
         uint64_t ue_length = g_pmm_map[i].length - (ue_base - g_pmm_map[i].base);
         if(ue_base + ue_length > area.end) ue_length -= (ue_base + ue_length) - area.end;
         if(ue_length < length) continue; // claim does not fit inside entry
 
         pmm_map_set(ue_base, length, type, true);
-        return (void *) (uintptr_t) ue_base;
+        return ue_base;
+    }
+    return 0;
+}
+
+static void bitmap_set(page_cache_t *cache, size_t index, size_t count, bool used) {
+    for(size_t i = index; i < index + count; i++) {
+        if(used) {
+            cache->bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+        } else {
+            cache->bitmap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        }
+    }
+}
+
+static page_cache_t *cache_find(pmm_map_area_t area, pmm_map_type_t type, bool top_down) {
+    for(size_t i = 0; i < CACHE_COUNT; i++) {
+        if(g_caches[i].area.end == 0) {
+            g_caches[i].area = area;
+            g_caches[i].type = type;
+            g_caches[i].top_down = top_down;
+        }
+        if(g_caches[i].area.start != area.start || g_caches[i].area.end != area.end) continue;
+        if(g_caches[i].type != type || g_caches[i].top_down != top_down) continue;
+        return &g_caches[i];
     }
-    panic("out of memory");
-    __builtin_unreachable();
+    return NULL;
+}
+
+/// Hand the free pages of the cached chunk back to the map and drop the chunk.
+static void cache_retire(page_cache_t *cache) {
+    size_t run_start = 0, run_length = 0;
+    for(size_t i = 0; i <= cache->page_count; i++) {
+        if(i < cache->page_count && (cache->bitmap[i / 64] & ((uint64_t) 1 << (i % 64))) == 0) {
+            if(run_length++ == 0) run_start = i;
+            continue;
+        }
+        if(run_length > 0) pmm_map_set(cache->base + run_start * PMM_GRANULARITY, run_length * PMM_GRANULARITY, PMM_MAP_TYPE_FREE, true);
+        run_length = 0;
+    }
+    cache->base = 0;
+    cache->page_count = 0;
+    cache->hint = 0;
+    memset(cache->bitmap, 0, sizeof(cache->bitmap));
+}
+
+static uint64_t cache_alloc(page_cache_t *cache, size_t page_count) {
+    size_t run = 0;
+    for(size_t i = cache->hint; i < cache->page_count; i++) {
+        if(i % 64 == 0 && cache->bitmap[i / 64] == UINT64_MAX) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if((cache->bitmap[i / 64] & ((uint64_t) 1 << (i % 64))) != 0) {
+            run = 0;
+            continue;
+        }
+        if(++run < page_count) continue;
+
+        size_t index = i + 1 - page_count;
+        bitmap_set(cache, index, page_count, true);
+        if(index == cache->hint) cache->hint = index + page_count;
+        return cache->base + index * PMM_GRANULARITY;
+    }
+    return 0;
+}
+
+static bool cache_contains(page_cache_t *cache, uint64_t address, size_t length) {
+    return cache->page_count != 0 && address < cache->base + cache->page_count * PMM_GRANULARITY && address + length > cache->base;
+}
+
+static uint64_t cache_refill(page_cache_t *cache, size_t page_count) {
+    uint64_t address = cache_alloc(cache, page_count);
+    if(address != 0) return address;
+
+    cache_retire(cache);
+    for(size_t chunk_size = CACHE_CHUNK_PAGES; chunk_size >= page_count; chunk_size /= 2) {
+        uint64_t base = map_claim(cache->area, chunk_size, PMM_GRANULARITY, cache->type, cache->top_down);
+        if(base == 0) continue;
+
+        cache->base = base;
+        cache->page_count = chunk_size;
+        return cache_alloc(cache, page_count);
+    }
+    return 0;
+}
+
+void pmm_cache_flush() {
+    for(size_t i = 0; i < CACHE_COUNT; i++) {
+        if(g_caches[i].page_count == 0) continue;
+        cache_retire(&g_caches[i]);
+    }
+}
+
+bool pmm_alloc_at(uint64_t address, size_t page_count, pmm_map_type_t type) {
+    size_t length = page_count * PMM_GRANULARITY;
+    for(size_t i = 0; i < CACHE_COUNT; i++) {
+        if(cache_contains(&g_caches[i], address, length)) cache_retire(&g_caches[i]);
+    }
+    map_reserve(MAP_CLAIM_ENTRIES);
+
+    size_t i = map_search(address);
+    if(i == g_pmm_map_size || g_pmm_map[i].type != PMM_MAP_TYPE_FREE) return false;
+    if(g_pmm_map[i].base > address || g_pmm_map[i].base + g_pmm_map[i].length < address + length) return false;
+
+    pmm_map_set(address, length, type, true);
+    return true;
+}
+
+static void *alloc(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type, bool top_down) {
+    if(page_count == 0) panic("zero page allocation");
+
+    // Low memory is too small and too precious to hold cached chunks
+    if(area.start >= PMM_AREA_STANDARD.start && page_count <= CACHE_MAX_RUN && alignment == PMM_GRANULARITY && (type == PMM_MAP_TYPE_ALLOCATED || type == PMM_MAP_TYPE_SCRATCH)) {
+        page_cache_t *cache = cache_find(area, type, top_down);
+        if(cache != NULL) {
+            uint64_t address = cache_refill(cache, page_count);
+            if(address != 0) return (void *) (uintptr_t) address;
+        }
+    }
+
+    uint64_t address = map_claim(area, page_count, alignment, type, top_down);
+    if(address == 0) {
+        // Cached chunks might be holding on to the memory needed
+        pmm_cache_flush();
+        address = map_claim(area, page_count, alignment, type, top_down);
+    }
+    if(address == 0) panic("out of memory");
+    return (void *) (uintptr_t) address;
+}
+
+void *pmm_alloc_ext(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type) {
+    return alloc(area, page_count, alignment, type, false);
 }
 
 void *pmm_alloc(pmm_map_area_t area, size_t page_count) {
-    return pmm_alloc_ext(area, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED);
+    return alloc(area, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED, false);
+}
+
+void *pmm_alloc_scratch(pmm_map_area_t area, size_t page_count) {
+    return alloc(area, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_SCRATCH, false);
+}
+
+void *pmm_alloc_persistent(size_t page_count) {
+    return alloc(PMM_AREA_STANDARD, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED, true);
+}
+
+void *pmm_try_alloc_persistent(pmm_map_area_t area, size_t page_count) {
+    return (void *) (uintptr_t) map_claim(area, page_count, PMM_GRANULARITY, PMM_MAP_TYPE_ALLOCATED, true);
 }
 
 void pmm_free(void *address, size_t page_count) {
+    uint64_t base = (uintptr_t) address;
+    uint64_t end = base + page_count * PMM_GRANULARITY;
+    for(size_t i = 0; i < CACHE_COUNT; i++) {
+        page_cache_t *cache = &g_caches[i];
+        if(!cache_contains(cache, base, end - base)) continue;
+
+        // Ranges grown in place with `pmm_alloc_at` can extend past their chunk, only the part inside it is in the bitmap
+        uint64_t cache_end = cache->base + cache->page_count * PMM_GRANULARITY;
+        uint64_t low = base > cache->base ? base : cache->base;
+        uint64_t high = end < cache_end ? end : cache_end;
+
+        size_t index = (low - cache->base) / PMM_GRANULARITY;
+        bitmap_set(cache, index, (high - low) / PMM_GRANULARITY, false);
+        if(index < cache->hint) cache->hint = index;
+
+        if(base < low) pmm_free(address, (low - base) / PMM_GRANULARITY);
+        if(high < end) pmm_free((void *) (uintptr_t) high, (end - high) / PMM_GRANULARITY);
+        return;
+    }
     pmm_map_set((uint64_t) (uintptr_t) address, page_count * PMM_GRANULARITY, PMM_MAP_TYPE_FREE, true);
 }
+
+void pmm_release_scratch() {
+    pmm_cache_flush();
+    for(size_t i = 0; i < g_pmm_map_size; i++) {
+        if(g_pmm_map[i].type != PMM_MAP_TYPE_SCRATCH) continue;
+
+        uint64_t base = g_pmm_map[i].base;
+        pmm_map_set(base, g_pmm_map[i].length, PMM_MAP_TYPE_FREE, true);
+        i = map_search(base);
+    }
+}
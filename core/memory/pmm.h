@@ -15,11 +15,13 @@
 #error Unimplemented
 #endif
 
-#define PMM_MAP_MAX_ENTRIES 1024
+#define PMM_MAP_INITIAL_CAPACITY 256
 
 typedef enum {
     PMM_MAP_TYPE_FREE,
     PMM_MAP_TYPE_ALLOCATED,
+    PMM_MAP_TYPE_SCRATCH,
+    PMM_MAP_TYPE_BOOT_INFO,
     PMM_MAP_TYPE_EFI_RECLAIMABLE,
     PMM_MAP_TYPE_ACPI_RECLAIMABLE,
     PMM_MAP_TYPE_ACPI_NVS,
@@ -38,7 +40,7 @@ typedef struct {
 } pmm_map_area_t;
 
 extern size_t g_pmm_map_size;
-extern pmm_map_entry_t g_pmm_map[PMM_MAP_MAX_ENTRIES];
+extern pmm_map_entry_t *g_pmm_map;
 
 void pmm_map_set(uint64_t base, uint64_t length, pmm_map_type_t type, bool force);
 void pmm_map_add(uint64_t base, uint64_t length, pmm_map_type_t type);
@@ -47,3 +49,18 @@ bool pmm_alloc_at(uint64_t address, size_t page_count, pmm_map_type_t type);
 void *pmm_alloc_ext(pmm_map_area_t area, size_t page_count, size_t alignment, pmm_map_type_t type);
 void *pmm_alloc(pmm_map_area_t area, size_t count);
 void pmm_free(void *address, size_t count);
+
+/// Allocate pages that are only needed until handoff, they are released in bulk by `pmm_release_scratch`.
+void *pmm_alloc_scratch(pmm_map_area_t area, size_t page_count);
+
+/// Allocate pages that outlive handoff, these are packed downwards from the top of memory.
+void *pmm_alloc_persistent(size_t page_count);
+
+/// Allocate pages that outlive handoff from the top of `area`, returns NULL instead of panicking when it is exhausted.
+void *pmm_try_alloc_persistent(pmm_map_area_t area, size_t page_count);
+
+/// Return every scratch page to the map as free memory.
+void pmm_release_scratch();
+
+/// Return the unused pages of the small allocation caches to the map, making the map accurate.
+void pmm_cache_flush();
@@ -399,11 +399,14 @@ static_assert(sizeof(boot_params_t) == PMM_GRANULARITY);
 #endif
 
     // Load memory map
+    pmm_cache_flush();
     for(size_t i = 0; i < g_pmm_map_size; i++) {
         linux_e820_type_t e820_type = LINUX_E820_TYPE_RESERVED;
         switch(g_pmm_map[i].type) {
             case PMM_MAP_TYPE_RESERVED:
             case PMM_MAP_TYPE_ALLOCATED:
+            case PMM_MAP_TYPE_SCRATCH:
+            case PMM_MAP_TYPE_BOOT_INFO:
             case PMM_MAP_TYPE_EFI_RECLAIMABLE:  e820_type = LINUX_E820_TYPE_RESERVED; break;
             case PMM_MAP_TYPE_FREE:             e820_type = LINUX_E820_TYPE_USABLE; break;
             case PMM_MAP_TYPE_ACPI_RECLAIMABLE: e820_type = LINUX_E820_TYPE_ACPI_RECLAIMABLE; break;
@@ -7,6 +7,8 @@
 #include "common/elf.h"
 #include "common/log.h"
 #include "common/panic.h"
+#include "common/timeline.h"
+#include "dev/numa.h"
 #include "fs/vfs.h"
 #include "lib/math.h"
 #include "lib/mem.h"
@@ -14,6 +16,12 @@
 #include "memory/heap.h"
 #include "memory/pmm.h"
 
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/gdt.h"
+#include "arch/x86_64/lapic.h"
+#include "arch/x86_64/topology.h"
+#include "arch/x86_64/tsc.h"
+
 #include <stddef.h>
 #include <stdint.h>
 #include <tartarus.h>
@@ -22,26 +30,261 @@
 #include "arch/uefi/uefi.h"
 #endif
 
-#define MAJOR_VERSION 2
+#define MAJOR_VERSION 3
 #define MINOR_VERSION 0
 
 #define BSP_STACK_PGCNT 16
 #define AP_STACK_PGCNT 4
 
-#define HHDM_OFFSET 0xFFFF800000000000
-#define HHDM_CAST(TYPE, ADDRESS) ((__TARTARUS_PTR(TYPE))((uint64_t) (uintptr_t) (ADDRESS) + HHDM_OFFSET))
+#define HHDM_OFFSET_4LEVEL 0xFFFF'8000'0000'0000
+#define HHDM_OFFSET_5LEVEL 0xFF00'0000'0000'0000
+#define HHDM_CAST(TYPE, ADDRESS) ((__TARTARUS_PTR(TYPE))((uint64_t) (uintptr_t) (ADDRESS) + g_hhdm_offset))
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MM_SLACK 8
+
+#define BITMAP_MAX_WORKERS 16
+#define BITMAP_PART_ALIGNMENT 512 // pages, one cache line of bitmap
+
+typedef struct {
+    const char *path;
+    vfs_node_t *node;
+    uint64_t paddr;
+    size_t size;
+} loaded_module_t;
+
+typedef struct {
+    uintptr_t base;
+    size_t size;
+    size_t offset;
+} arena_t;
+
+typedef struct {
+    const char *directory;
+    const char *pattern;
+    loaded_module_t *modules;
+    size_t count, capacity;
+} module_list_t;
+
+static uint64_t g_hhdm_offset = HHDM_OFFSET_4LEVEL;
+
+static void bitmap_fill(smp_bitmap_job_t *job) {
+    uint8_t *bitmap = (uint8_t *) (uintptr_t) job->bitmap;
+    memset(&bitmap[job->page_start / 8], 0, (job->page_end - job->page_start) / 8);
+
+    tartarus_mm_entry_t *entries = (tartarus_mm_entry_t *) (uintptr_t) job->entries;
+    for(size_t i = 0; i < job->entry_count; i++) {
+        if(entries[i].type != TARTARUS_MM_TYPE_USABLE) continue;
+
+        uint64_t page = entries[i].base / PMM_GRANULARITY;
+        uint64_t end = (entries[i].base + entries[i].length) / PMM_GRANULARITY;
+        if(page < job->page_start) page = job->page_start;
+        if(end > job->page_end) end = job->page_end;
+
+        for(; page < end && page % 8 != 0; page++) bitmap[page / 8] |= 1 << (page % 8);
+        if(page < end && end - page >= 8) {
+            memset(&bitmap[page / 8], 0xFF, (end - page) / 8);
+            page += MATH_FLOOR(end - page, 8);
+        }
+        for(; page < end; page++) bitmap[page / 8] |= 1 << (page % 8);
+    }
+    job->done = 1;
+}
+
+static void cpu_topology(tartarus_cpu_topology_t *cpu_topology, x86_64_cpuid_registers_t *cpuid_dump) {
+    x86_64_topology_t topology;
+    x86_64_topology_decode(cpuid_dump, &topology);
+
+    cpu_topology->apic_id = topology.apic_id;
+    cpu_topology->package_id = topology.apic_id >> topology.package_shift;
+    cpu_topology->core_id = (topology.apic_id & (((uint64_t) 1 << topology.package_shift) - 1)) >> topology.smt_shift;
+    cpu_topology->smt_id = topology.apic_id & (((uint64_t) 1 << topology.smt_shift) - 1);
+    cpu_topology->smt_shift = topology.smt_shift;
+    cpu_topology->package_shift = topology.package_shift;
+    cpu_topology->cache_count = topology.cache_count;
+    for(size_t i = 0; i < topology.cache_count; i++) {
+        tartarus_cache_t *cache = &cpu_topology->caches[i];
+        cache->level = topology.caches[i].level;
+        cache->type = (tartarus_cache_type_t) topology.caches[i].type;
+        cache->line_size = topology.caches[i].line_size;
+        cache->ways = topology.caches[i].ways;
+        cache->sets = topology.caches[i].sets;
+        cache->sharing_shift = topology.caches[i].sharing_shift;
+        cache->id = topology.apic_id >> topology.caches[i].sharing_shift;
+        cache->size = topology.caches[i].size;
+    }
+}
+
+static void *arena_take(arena_t *arena, size_t size) {
+    if(arena->offset + size > arena->size) panic("boot info arena overflow");
+    void *address = (void *) (arena->base + arena->offset);
+    memset(address, 0, size);
+    arena->offset += MATH_CEIL(size, ARENA_ALIGNMENT);
+    return address;
+}
+
+static tartarus_timeline_stage_t timeline_stage(timeline_stage_t stage) {
+    switch(stage) {
+        case TIMELINE_STAGE_FIRMWARE_ENTRY:    return TARTARUS_TIMELINE_STAGE_FIRMWARE_ENTRY;
+        case TIMELINE_STAGE_MEMORY_MAP:        return TARTARUS_TIMELINE_STAGE_MEMORY_MAP;
+        case TIMELINE_STAGE_DISKS:             return TARTARUS_TIMELINE_STAGE_DISKS;
+        case TIMELINE_STAGE_CONFIG:            return TARTARUS_TIMELINE_STAGE_CONFIG;
+        case TIMELINE_STAGE_FRAMEBUFFER:       return TARTARUS_TIMELINE_STAGE_FRAMEBUFFER;
+        case TIMELINE_STAGE_KERNEL:            return TARTARUS_TIMELINE_STAGE_KERNEL;
+        case TIMELINE_STAGE_MODULES:           return TARTARUS_TIMELINE_STAGE_MODULES;
+        case TIMELINE_STAGE_BOOTSERVICES_EXIT: return TARTARUS_TIMELINE_STAGE_BOOTSERVICES_EXIT;
+        case TIMELINE_STAGE_SMP:               return TARTARUS_TIMELINE_STAGE_SMP;
+        case TIMELINE_STAGE_HANDOFF:
+        case TIMELINE_STAGE_COUNT:             break;
+    }
+    return TARTARUS_TIMELINE_STAGE_HANDOFF;
+}
+
+#ifdef __UEFI
+extern nullptr_t g_x86_64_protocol_tartarus_la57_start[];
+extern nullptr_t g_x86_64_protocol_tartarus_la57_end[];
+#endif
 
-[[noreturn]] extern void x86_64_protocol_tartarus_handoff(uint64_t entry, __TARTARUS_PTR(void *) stack, uint64_t top_page_table, uint64_t boot_info, uint16_t version);
+/// `la57` is zero to keep 4-level paging. On UEFI paging is already enabled so it is the address of the low trampoline that switches modes
+[[noreturn]] extern void x86_64_protocol_tartarus_handoff(uint64_t entry, __TARTARUS_PTR(void *) stack, uint64_t top_page_table, uint64_t boot_info, uint16_t version, uint64_t la57);
+extern nullptr_t x86_64_protocol_tartarus_handoff_end[];
+
+static void module_add(module_list_t *list, const char *path, vfs_node_t *node) {
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->modules = heap_realloc(list->modules, sizeof(loaded_module_t) * list->capacity);
+    }
+    list->modules[list->count].path = path;
+    list->modules[list->count].node = node;
+    list->modules[list->count].size = node->ops->get_size(node);
+    list->count++;
+}
+
+/// Case-insensitive match supporting `*` and `?`, FAT names are case-insensitive.
+static bool glob_match(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *star_name = NULL;
+    while(*name != '\0') {
+        char p = (*pattern >= 'A' && *pattern <= 'Z') ? *pattern + ('a' - 'A') : *pattern;
+        char n = (*name >= 'A' && *name <= 'Z') ? *name + ('a' - 'A') : *name;
+        if(*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+        } else if(*pattern == '?' || (*pattern != '\0' && p == n)) {
+            pattern++;
+            name++;
+        } else if(star != NULL) {
+            pattern = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while(*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+static bool module_scan_entry(void *context, const char *name, vfs_node_t *node, bool is_directory) {
+    module_list_t *list = context;
+    if(is_directory || (list->pattern != NULL && !glob_match(list->pattern, name))) return true;
+
+    size_t directory_length = string_length(list->directory);
+    char *path = heap_alloc(directory_length + string_length(name) + 2);
+    string_copy(path, list->directory);
+    path[directory_length] = '/';
+    string_copy(&path[directory_length + 1], name);
+    module_add(list, path, node);
+    return true;
+}
+
+/// Resolve a module entry, a file path, a directory (every file in it) or a glob in the last component.
+static void module_resolve(module_list_t *list, vfs_t *vfs, const char *path) {
+    size_t length = string_length(path);
+    size_t pattern_start = 0;
+    bool is_glob = false;
+    for(size_t i = 0; i < length; i++) {
+        if(path[i] == '/') pattern_start = i + 1;
+        if(path[i] == '*' || path[i] == '?') is_glob = true;
+    }
+
+    if(!is_glob) {
+        vfs_node_t *node = vfs_lookup(vfs, path);
+        if(node == NULL) {
+            log(LOG_LEVEL_WARN, "Module %s not found", path);
+            return;
+        }
+
+        size_t count = list->count;
+        list->directory = path;
+        list->pattern = NULL;
+        if(!node->ops->readdir(node, module_scan_entry, list)) {
+            module_add(list, path, node);
+            return;
+        }
+        if(list->count == count) log(LOG_LEVEL_WARN, "Module directory %s is empty", path);
+        return;
+    }
+
+    // Only the last component may hold wildcards, its directory is scanned once
+    size_t directory_length = pattern_start > 0 ? pattern_start - 1 : 0;
+    char *directory = heap_alloc(directory_length + 1);
+    memcpy(directory, path, directory_length);
+    directory[directory_length] = '\0';
+    for(size_t i = 0; i < directory_length; i++) {
+        if(directory[i] == '*' || directory[i] == '?') panic("module path %s has wildcards outside of its last component", path);
+    }
+
+    vfs_node_t *directory_node = vfs_lookup(vfs, directory);
+    size_t count = list->count;
+    list->directory = directory;
+    list->pattern = &path[pattern_start];
+    if(directory_node == NULL || !directory_node->ops->readdir(directory_node, module_scan_entry, list)) {
+        log(LOG_LEVEL_WARN, "Module directory %s not found", directory);
+        return;
+    }
+    if(list->count == count) log(LOG_LEVEL_WARN, "No modules match %s", path);
+}
+
+static void identity_map(ptm_address_space_t *address_space, uintptr_t address, size_t size) {
+    uint64_t base = MATH_FLOOR(address, PTM_PAGE_GRANULARITY);
+    arch_ptm_map(address_space, base, base, MATH_CEIL(address + size, PTM_PAGE_GRANULARITY) - base, PTM_FLAG_READ | PTM_FLAG_WRITE | PTM_FLAG_EXEC);
+}
 
 [[noreturn]] void protocol_tartarus(config_t *config, vfs_node_t *kernel_node, fb_t *fb) {
     log(LOG_LEVEL_INFO, "Tartarus Protocol Version %u.%u", MAJOR_VERSION, MINOR_VERSION);
 
-    ptm_address_space_t *address_space = arch_ptm_create_address_space();
+    size_t level_count = 4;
+    if(config_find_bool(config, "five_level_paging", false)) {
+        if(arch_ptm_max_level_count() >= 5) {
+            level_count = 5;
+            g_hhdm_offset = HHDM_OFFSET_5LEVEL;
+        } else {
+            log(LOG_LEVEL_WARN, "5-level paging not supported, falling back to 4-level paging");
+        }
+    }
+    ptm_address_space_t *address_space = arch_ptm_create_address_space(level_count);
+    log(LOG_LEVEL_INFO, "Using %zu-level paging", level_count);
+
+    // The LA57 switch happens with paging disabled, so on UEFI it has to run from identity mapped low memory
+    uint64_t la57 = 0;
+    if(address_space->level_count == 5) {
+#ifdef __UEFI
+        size_t trampoline_size = (uintptr_t) g_x86_64_protocol_tartarus_la57_end - (uintptr_t) g_x86_64_protocol_tartarus_la57_start;
+        if(trampoline_size > PMM_GRANULARITY / 2) panic("LA57 trampoline does not fit into its page");
+        void *trampoline = pmm_alloc(PMM_AREA_LOWMEM, 1);
+        memcpy(trampoline, (void *) g_x86_64_protocol_tartarus_la57_start, trampoline_size);
+        la57 = (uintptr_t) trampoline;
+#else
+        la57 = 1;
+#endif
+    }
+
+    bool minimal_identity_map = config_find_bool(config, "minimal_identity_map", false);
 
     // Freeze the memory map
     size_t frozen_map_size = g_pmm_map_size;
     pmm_map_entry_t *frozen_map = heap_alloc(sizeof(pmm_map_entry_t) * frozen_map_size);
-    memcpy(frozen_map, &g_pmm_map, sizeof(pmm_map_entry_t) * frozen_map_size);
+    memcpy(frozen_map, g_pmm_map, sizeof(pmm_map_entry_t) * frozen_map_size);
 
     // Setup HHDM
     log(LOG_LEVEL_INFO, "Mapping HHDM");
@@ -50,6 +293,8 @@
         switch(frozen_map[i].type) {
             case PMM_MAP_TYPE_FREE:
             case PMM_MAP_TYPE_ALLOCATED:
+            case PMM_MAP_TYPE_SCRATCH:
+            case PMM_MAP_TYPE_BOOT_INFO:
             case PMM_MAP_TYPE_EFI_RECLAIMABLE:
             case PMM_MAP_TYPE_ACPI_RECLAIMABLE: break;
             default:                            continue;
@@ -65,10 +310,20 @@
 
         if(base + length > hhdm_size) hhdm_size = base + length;
 
-        arch_ptm_map(address_space, base, base, length, PTM_FLAG_READ | PTM_FLAG_WRITE | PTM_FLAG_EXEC);
-        arch_ptm_map(address_space, base, HHDM_OFFSET + base, length, PTM_FLAG_READ | PTM_FLAG_WRITE);
+        if(!minimal_identity_map) arch_ptm_map(address_space, base, base, length, PTM_FLAG_READ | PTM_FLAG_WRITE | PTM_FLAG_EXEC);
+        arch_ptm_map(address_space, base, g_hhdm_offset + base, length, PTM_FLAG_READ | PTM_FLAG_WRITE);
+    }
+    log(LOG_LEVEL_INFO, "HHDM mapped at offset %#llx (of size %#llx)", g_hhdm_offset, hhdm_size);
+
+    // Otherwise only identity map what keeps running across the switch to this address space,
+    // stacks and parking mailboxes are already referenced through the HHDM
+    if(minimal_identity_map) {
+        log(LOG_LEVEL_INFO, "Identity mapping handoff code only");
+        identity_map(address_space, (uintptr_t) x86_64_protocol_tartarus_handoff, (uintptr_t) x86_64_protocol_tartarus_handoff_end - (uintptr_t) x86_64_protocol_tartarus_handoff);
+        identity_map(address_space, (uintptr_t) g_x86_64_gdt, g_x86_64_gdt_limit + 1);
+        identity_map(address_space, (uintptr_t) g_smp_reserved_init_page, PMM_GRANULARITY);
+        if(la57 > 1) identity_map(address_space, la57, PMM_GRANULARITY);
     }
-    log(LOG_LEVEL_INFO, "HHDM mapped at offset %#llx (of size %#llx)", HHDM_OFFSET, hhdm_size);
 
     heap_free(frozen_map);
 
@@ -83,9 +338,9 @@
         arch_ptm_map(
             address_space,
             (uint64_t) (uintptr_t) MATH_FLOOR(fb->address, PTM_PAGE_GRANULARITY),
-            (uint64_t) ((uintptr_t) MATH_FLOOR(fb->address, PTM_PAGE_GRANULARITY)) + HHDM_OFFSET,
+            (uint64_t) ((uintptr_t) MATH_FLOOR(fb->address, PTM_PAGE_GRANULARITY)) + g_hhdm_offset,
             MATH_CEIL(fb->size, PTM_PAGE_GRANULARITY),
-            PTM_FLAG_READ | PTM_FLAG_WRITE
+            PTM_FLAG_READ | PTM_FLAG_WRITE | PTM_FLAG_WRITE_COMBINE
         );
     }
 
@@ -94,44 +349,46 @@
     elf_loaded_image_t *kernel = elf_load(kernel_node, address_space);
     if(kernel == NULL) panic("failed to load kernel");
     log(LOG_LEVEL_INFO, "Kernel loaded (entry=%#llx)", kernel->entry);
+    timeline_mark(TIMELINE_STAGE_KERNEL);
+
+    // Resolve modules, directories and globs expand in on-disk order
+    module_list_t module_list = {};
+    size_t module_entry_count = config_key_count(config, "module", CONFIG_ENTRY_TYPE_STRING);
+    for(size_t i = 0; i < module_entry_count; i++) module_resolve(&module_list, kernel_node->vfs, config_find_string_at(config, "module", NULL, i));
+    loaded_module_t *modules = module_list.modules;
+    size_t module_count = module_list.count;
+
+    // Pack modules into one region in config order, each starting at the module alignment
+    uintmax_t module_alignment = config_find_number(config, "module_alignment", PMM_GRANULARITY);
+    if(module_alignment < PMM_GRANULARITY || (module_alignment & (module_alignment - 1)) != 0) panic("module alignment %#llx is not a power of two of at least a page", (uint64_t) module_alignment);
+
+    size_t module_region_size = 0;
+    for(size_t i = 0; i < module_count; i++) {
+        modules[i].paddr = module_region_size;
+        module_region_size = MATH_CEIL(module_region_size + modules[i].size, module_alignment);
+    }
 
     // Load modules
-    size_t module_count = config_key_count(config, "module", CONFIG_ENTRY_TYPE_STRING);
-    tartarus_module_t *modules = heap_alloc(sizeof(tartarus_module_t) * module_count);
-    for(size_t i = 0, j = 0; j < module_count; i++) {
-        const char *module_path = config_find_string_at(config, "module", NULL, i);
-        if(module_path == NULL) {
-        skip_module:
-            modules = heap_realloc(modules, sizeof(tartarus_module_t) * --module_count);
-            continue;
-        }
-
-        vfs_node_t *module_node = vfs_lookup(kernel_node->vfs, module_path);
-        if(module_node == NULL) {
-            log(LOG_LEVEL_WARN, "Module %s not found", module_path);
-            goto skip_module;
-        }
-
-        size_t module_size = module_node->ops->get_size(module_node);
-        void *module_addr = pmm_alloc(PMM_AREA_STANDARD, MATH_DIV_CEIL(module_size, PMM_GRANULARITY));
-        if(module_node->ops->read(module_node, module_addr, 0, module_size) != module_size) {
-            pmm_free(module_addr, MATH_DIV_CEIL(module_size, PMM_GRANULARITY));
-            log(LOG_LEVEL_WARN, "failed to load module %s", module_path);
-            goto skip_module;
+    if(module_region_size > 0) {
+        uintptr_t module_region = (uintptr_t) pmm_alloc_ext(PMM_AREA_STANDARD, module_region_size / PMM_GRANULARITY, module_alignment, PMM_MAP_TYPE_ALLOCATED);
+        log(LOG_LEVEL_DEBUG, "Module region at %#lx (of size %#lx)", module_region, module_region_size);
+
+        size_t loaded_count = 0;
+        for(size_t i = 0; i < module_count; i++) {
+            modules[i].paddr += module_region;
+            if(modules[i].node->ops->read(modules[i].node, (void *) (uintptr_t) modules[i].paddr, 0, modules[i].size) != modules[i].size) {
+                log(LOG_LEVEL_WARN, "failed to load module %s", modules[i].path);
+                continue;
+            }
+            log(LOG_LEVEL_INFO, "Loaded module %s at %#llx (of size %#lx)", modules[i].path, modules[i].paddr, modules[i].size);
+            modules[loaded_count++] = modules[i];
         }
-
-        char *module_name = heap_alloc(string_length(module_path) + 1);
-        string_copy(module_name, module_path);
-        modules[j].name = HHDM_CAST(char *, module_name);
-        modules[j].paddr = (uint64_t) (uintptr_t) module_addr;
-        modules[j].size = module_size;
-        j += 1;
-
-        log(LOG_LEVEL_INFO, "Loaded module %s at %#lx (of size %#lx)", module_path, (uintptr_t) module_addr, module_size);
+        module_count = loaded_count;
     }
+    timeline_mark(TIMELINE_STAGE_MODULES);
 
     // Allocate stack
-    void *stack = pmm_alloc(PMM_AREA_STANDARD, BSP_STACK_PGCNT) + (BSP_STACK_PGCNT * PMM_GRANULARITY);
+    void *stack = pmm_alloc_persistent(BSP_STACK_PGCNT) + (BSP_STACK_PGCNT * PMM_GRANULARITY);
 
     // Find ACPI
     acpi_rsdp_t *rsdp = NULL;
@@ -145,17 +402,119 @@
 #if defined(__UEFI)
     log(LOG_LEVEL_INFO, "Exiting UEFI bootservices");
     uefi_bootservices_exit();
+    timeline_mark(TIMELINE_STAGE_BOOTSERVICES_EXIT);
 #endif
 
+    // Real-time delays during SMP init depend on the TSC frequency
+    x86_64_tsc_calibrate(rsdp);
+
+    // Parse the NUMA topology
+    numa_topology_t *numa = NULL;
+    if(rsdp != NULL) numa = numa_parse(rsdp);
+
     // Initialize SMP
     smp_cpu_t *cpus = NULL;
     if(config_find_bool(config, "smp", true)) {
-        cpus = smp_initialize_aps(rsdp, address_space, AP_STACK_PGCNT, HHDM_OFFSET);
+        cpus = smp_initialize_aps(rsdp, numa, address_space, AP_STACK_PGCNT, g_hhdm_offset);
         log(LOG_LEVEL_INFO, "Initialized SMP");
+        timeline_mark(TIMELINE_STAGE_SMP);
     }
 
+    // Allocate the page bitmap. Allocated pages can still turn usable before the map is exported (cache chunks, scratch,
+    // freed boot info), so it covers every page up to the end of the last entry the PMM manages whatever its current type
+    pmm_cache_flush();
+    uint8_t *bitmap = NULL;
+    uint64_t bitmap_page_count = 0;
+    size_t bitmap_size = 0;
+    size_t bitmap_worker_count = 1;
+    uint64_t *bitmap_worker_parks[BITMAP_MAX_WORKERS];
+    smp_bitmap_job_t *bitmap_jobs = NULL;
+    if(config_find_bool(config, "page_bitmap", false)) {
+        for(size_t i = 0; i < g_pmm_map_size; i++) {
+            pmm_map_type_t type = g_pmm_map[i].type;
+            if(type != PMM_MAP_TYPE_FREE && type != PMM_MAP_TYPE_SCRATCH && type != PMM_MAP_TYPE_ALLOCATED && type != PMM_MAP_TYPE_BOOT_INFO) continue;
+            uint64_t end = (g_pmm_map[i].base + g_pmm_map[i].length) / PMM_GRANULARITY;
+            if(end > bitmap_page_count) bitmap_page_count = end;
+        }
+        bitmap_size = MATH_CEIL(bitmap_page_count, BITMAP_PART_ALIGNMENT) / 8;
+        bitmap = pmm_alloc_ext(PMM_AREA_STANDARD, MATH_DIV_CEIL(bitmap_size, PMM_GRANULARITY), PMM_GRANULARITY, PMM_MAP_TYPE_BOOT_INFO);
+
+        // Parked APs help filling the bitmap, the BSP takes the first part
+        for(smp_cpu_t *cpu = cpus; cpu != NULL && bitmap_worker_count < BITMAP_MAX_WORKERS; cpu = cpu->next) {
+            if(cpu->init_failed || cpu->is_bsp) continue;
+            bitmap_worker_parks[bitmap_worker_count++] = cpu->park_address;
+        }
+        bitmap_jobs = heap_alloc_persistent(sizeof(smp_bitmap_job_t) * bitmap_worker_count);
+    }
+
+    // Firmware is done with the BSP so it can load the memory types and vector state now, APs did during init
+    bool memory_types = arch_ptm_load_memory_types();
+    size_t vector_save_area_size = x86_64_cpu_enable_vector_state();
+
+    size_t extension_count = 1;
+    if(bitmap != NULL) extension_count++;
+    if(memory_types) extension_count++;
+    if(numa != NULL) extension_count++;
+    extension_count++; // Topology
+    extension_count++; // Vector state
+    if(g_x86_64_tsc_frequency != 0) extension_count++;
+
+    // Without SMP the BSP topology is recorded here, allocating before the arena is measured
+    x86_64_cpuid_registers_t *bsp_cpuid_dump = NULL;
+    if(cpus == NULL) {
+        bsp_cpuid_dump = heap_alloc(sizeof(x86_64_cpuid_registers_t) * x86_64_topology_leaf_count());
+        x86_64_topology_prepare(bsp_cpuid_dump);
+        x86_64_topology_record(bsp_cpuid_dump);
+    }
+
+    // Measure the boot info arena
+    size_t cpu_count = 0;
+    for(smp_cpu_t *cpu = cpus; cpu; cpu = cpu->next) cpu_count++;
+    if(cpus == NULL) cpu_count = 1;
+
+    size_t module_names_size = 0;
+    for(size_t i = 0; i < module_count; i++) module_names_size += MATH_CEIL(string_length(modules[i].path) + 1, ARENA_ALIGNMENT);
+
+    size_t fixed_size = MATH_CEIL(sizeof(tartarus_boot_info_t), ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_kernel_segment_t) * kernel->count, ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_framebuffer_t) * (fb != NULL ? 1 : 0), ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_module_t) * module_count, ARENA_ALIGNMENT) + module_names_size;
+    fixed_size += MATH_CEIL(sizeof(tartarus_cpu_t) * cpu_count, ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(__TARTARUS_PTR(tartarus_extension_t *)) * extension_count, ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_extension_timeline_t) + sizeof(tartarus_timeline_entry_t) * TIMELINE_STAGE_COUNT, ARENA_ALIGNMENT);
+    if(bitmap != NULL) fixed_size += MATH_CEIL(sizeof(tartarus_extension_page_bitmap_t), ARENA_ALIGNMENT);
+    if(memory_types) fixed_size += MATH_CEIL(sizeof(tartarus_extension_pat_t), ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_extension_topology_t) + sizeof(tartarus_cpu_topology_t) * cpu_count, ARENA_ALIGNMENT);
+    if(g_x86_64_tsc_frequency != 0) fixed_size += MATH_CEIL(sizeof(tartarus_extension_tsc_t), ARENA_ALIGNMENT);
+    fixed_size += MATH_CEIL(sizeof(tartarus_extension_vector_state_t), ARENA_ALIGNMENT);
+    if(numa != NULL) {
+        fixed_size += MATH_CEIL(sizeof(tartarus_extension_numa_t), ARENA_ALIGNMENT);
+        fixed_size += MATH_CEIL(sizeof(uint32_t) * cpu_count, ARENA_ALIGNMENT);
+        fixed_size += MATH_CEIL(sizeof(tartarus_numa_memory_range_t) * numa->memory_range_count, ARENA_ALIGNMENT);
+        fixed_size += MATH_CEIL(numa->locality_count * numa->locality_count, ARENA_ALIGNMENT);
+    }
+
+    // Every memory map entry carries its domain in the NUMA extension
+    size_t mm_entry_size = sizeof(tartarus_mm_entry_t);
+    if(numa != NULL) mm_entry_size += sizeof(uint32_t);
+
+    // Allocate the arena, the memory map goes last and claiming the arena can itself grow the map.
+    // Retiring cached chunks splits map entries, flush them now so the release of scratch memory below cannot.
+    pmm_cache_flush();
+    arena_t arena = {};
+    size_t mm_capacity = 0;
+    do {
+        if(arena.base != 0) pmm_free((void *) arena.base, arena.size / PMM_GRANULARITY);
+        mm_capacity = g_pmm_map_size + ARENA_MM_SLACK;
+        arena.size = MATH_CEIL(fixed_size + mm_entry_size * mm_capacity + 2 * ARENA_ALIGNMENT, PMM_GRANULARITY);
+        arena.base = (uintptr_t) pmm_alloc_ext(PMM_AREA_STANDARD, arena.size / PMM_GRANULARITY, PMM_GRANULARITY, PMM_MAP_TYPE_BOOT_INFO);
+    } while(g_pmm_map_size > mm_capacity);
+    log(LOG_LEVEL_DEBUG, "Boot info arena at %#lx (of size %#lx)", arena.base, arena.size);
+
     // Setup boot info
-    tartarus_kernel_segment_t *kernel_segments = heap_alloc(sizeof(tartarus_kernel_segment_t) * kernel->count);
+    tartarus_boot_info_t *boot_info = arena_take(&arena, sizeof(tartarus_boot_info_t));
+
+    tartarus_kernel_segment_t *kernel_segments = arena_take(&arena, sizeof(tartarus_kernel_segment_t) * kernel->count);
     for(size_t i = 0; i < kernel->count; i++) {
         uint8_t flags = 0;
         if(kernel->regions[i]->read) flags |= TARTARUS_KERNEL_SEGMENT_FLAG_READ;
@@ -163,14 +522,14 @@
         if(kernel->regions[i]->execute) flags |= TARTARUS_KERNEL_SEGMENT_FLAG_EXECUTE;
 
         kernel_segments[i].flags = flags;
-        kernel_segments[i].paddr = kernel->paddr + (kernel->regions[i]->aligned_vaddr - kernel->aligned_vaddr);
+        kernel_segments[i].paddr = kernel->regions[i]->paddr;
         kernel_segments[i].vaddr = kernel->regions[i]->aligned_vaddr;
         kernel_segments[i].size = kernel->regions[i]->aligned_size;
     }
 
     tartarus_framebuffer_t *framebuffer = NULL;
     if(fb != NULL) {
-        framebuffer = heap_alloc(sizeof(tartarus_framebuffer_t));
+        framebuffer = arena_take(&arena, sizeof(tartarus_framebuffer_t));
         framebuffer->vaddr = HHDM_CAST(void *, fb->address);
         framebuffer->paddr = fb->address;
         framebuffer->size = fb->size;
@@ -186,27 +545,33 @@
         framebuffer->mask.blue_size = fb->mask_blue_size;
     }
 
-    tartarus_boot_info_t *boot_info = heap_alloc(sizeof(tartarus_boot_info_t));
+    tartarus_module_t *module_array = arena_take(&arena, sizeof(tartarus_module_t) * module_count);
+    for(size_t i = 0; i < module_count; i++) {
+        char *module_name = arena_take(&arena, string_length(modules[i].path) + 1);
+        string_copy(module_name, modules[i].path);
+        module_array[i].name = HHDM_CAST(char *, module_name);
+        module_array[i].paddr = modules[i].paddr;
+        module_array[i].size = modules[i].size;
+    }
+
     boot_info->acpi_rsdp_address = (tartarus_paddr_t) (uintptr_t) rsdp;
     boot_info->bsp_entry_stack_size = BSP_STACK_PGCNT * PMM_GRANULARITY;
     boot_info->ap_entry_stack_size = AP_STACK_PGCNT * PMM_GRANULARITY;
-    boot_info->hhdm_offset = HHDM_OFFSET;
+    boot_info->hhdm_offset = g_hhdm_offset;
     boot_info->hhdm_size = hhdm_size;
     boot_info->kernel_segment_count = kernel->count;
     boot_info->kernel_segments = HHDM_CAST(tartarus_kernel_segment_t *, kernel_segments);
     boot_info->framebuffer_count = framebuffer != NULL ? 1 : 0;
     boot_info->framebuffers = HHDM_CAST(tartarus_framebuffer_t *, framebuffer);
     boot_info->module_count = module_count;
-    boot_info->modules = HHDM_CAST(tartarus_module_t *, modules);
+    boot_info->modules = HHDM_CAST(tartarus_module_t *, module_array);
 
+    tartarus_cpu_t *cpu_array = arena_take(&arena, sizeof(tartarus_cpu_t) * cpu_count);
     if(cpus != NULL) {
-        uint8_t cpu_count = 0;
-        for(smp_cpu_t *cpu = cpus; cpu; cpu = cpu->next) cpu_count++;
-
-        tartarus_cpu_t *cpu_array = heap_alloc(sizeof(tartarus_cpu_t) * cpu_count);
         smp_cpu_t *cpu = cpus;
-        for(uint16_t i = 0; i < cpu_count; i++, cpu = cpu->next) {
-            cpu_array[i].flags = 0;
+        for(size_t i = 0; i < cpu_count; i++, cpu = cpu->next) {
+            cpu_array[i].flags = x86_64_lapic_is_x2apic() ? TARTARUS_CPU_FLAG_X2APIC : 0;
+            cpu_array[i].lapic_id = cpu->lapic_id;
             cpu_array[i].park_address = (__TARTARUS_PTR(tartarus_vaddr_t *)) 0;
             cpu_array[i].argument = (__TARTARUS_PTR(uint64_t *)) 0;
 
@@ -221,25 +586,141 @@
             cpu_array[i].park_address = HHDM_CAST(uint64_t *, cpu->park_address);
             cpu_array[i].argument = HHDM_CAST(uint64_t *, (uintptr_t) cpu->park_address + 8);
         }
+    } else {
+        cpu_array[0].flags = TARTARUS_CPU_FLAG_BOOT_OK | TARTARUS_CPU_FLAG_IS_BSP | (x86_64_lapic_is_x2apic() ? TARTARUS_CPU_FLAG_X2APIC : 0);
+        cpu_array[0].lapic_id = x86_64_lapic_id();
+        cpu_array[0].park_address = (__TARTARUS_PTR(tartarus_vaddr_t *)) 0;
+    }
+    boot_info->cpu_count = cpu_count;
+    boot_info->cpus = HHDM_CAST(tartarus_cpu_t *, cpu_array);
+    boot_info->park_control = cpus != NULL ? HHDM_CAST(tartarus_park_control_t *, g_smp_park_control) : (__TARTARUS_PTR(tartarus_park_control_t *)) 0;
+
+    // Setup extensions
+    __TARTARUS_PTR(tartarus_extension_t *) *extensions = arena_take(&arena, sizeof(__TARTARUS_PTR(tartarus_extension_t *)) * extension_count);
+
+    tartarus_extension_timeline_t *timeline = arena_take(&arena, sizeof(tartarus_extension_timeline_t) + sizeof(tartarus_timeline_entry_t) * TIMELINE_STAGE_COUNT);
+    timeline->header.id = TARTARUS_EXTENSION_TIMELINE;
+    timeline->header.version = TARTARUS_EXTENSION_TIMELINE_VERSION;
+    size_t extension_index = 0;
+    extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, timeline);
+
+    if(bitmap != NULL) {
+        tartarus_extension_page_bitmap_t *page_bitmap = arena_take(&arena, sizeof(tartarus_extension_page_bitmap_t));
+        page_bitmap->header.id = TARTARUS_EXTENSION_PAGE_BITMAP;
+        page_bitmap->header.version = TARTARUS_EXTENSION_PAGE_BITMAP_VERSION;
+        page_bitmap->header.size = sizeof(tartarus_extension_page_bitmap_t);
+        page_bitmap->page_size = PMM_GRANULARITY;
+        page_bitmap->page_count = bitmap_page_count;
+        page_bitmap->bitmap_paddr = (tartarus_paddr_t) (uintptr_t) bitmap;
+        page_bitmap->bitmap_size = bitmap_size;
+        page_bitmap->bitmap = HHDM_CAST(uint8_t *, bitmap);
+        extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, page_bitmap);
+    }
 
-        boot_info->cpu_count = cpu_count;
-        boot_info->cpus = HHDM_CAST(tartarus_cpu_t *, cpu_array);
+    if(memory_types) {
+        tartarus_extension_pat_t *pat = arena_take(&arena, sizeof(tartarus_extension_pat_t));
+        pat->header.id = TARTARUS_EXTENSION_PAT;
+        pat->header.version = TARTARUS_EXTENSION_PAT_VERSION;
+        pat->header.size = sizeof(tartarus_extension_pat_t);
+        pat->pat = PTM_X86_64_PAT;
+        extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, pat);
+    }
+
+    tartarus_extension_topology_t *topology = arena_take(&arena, sizeof(tartarus_extension_topology_t) + sizeof(tartarus_cpu_topology_t) * cpu_count);
+    topology->header.id = TARTARUS_EXTENSION_TOPOLOGY;
+    topology->header.version = TARTARUS_EXTENSION_TOPOLOGY_VERSION;
+    topology->header.size = sizeof(tartarus_extension_topology_t) + sizeof(tartarus_cpu_topology_t) * cpu_count;
+    topology->cpu_count = cpu_count;
+    if(cpus != NULL) {
+        smp_cpu_t *cpu = cpus;
+        for(size_t i = 0; i < cpu_count; i++, cpu = cpu->next) {
+            if(cpu->init_failed) continue;
+            cpu_topology(&topology->cpus[i], cpu->cpuid_dump);
+        }
     } else {
-        tartarus_cpu_t *bsp_cpu = heap_alloc(sizeof(tartarus_cpu_t));
-        bsp_cpu->flags = TARTARUS_CPU_FLAG_BOOT_OK | TARTARUS_CPU_FLAG_IS_BSP;
-        bsp_cpu->park_address = (__TARTARUS_PTR(tartarus_vaddr_t *)) 0;
+        cpu_topology(&topology->cpus[0], bsp_cpuid_dump);
+    }
+    extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, topology);
+
+    if(g_x86_64_tsc_frequency != 0) {
+        tartarus_extension_tsc_t *tsc = arena_take(&arena, sizeof(tartarus_extension_tsc_t));
+        tsc->header.id = TARTARUS_EXTENSION_TSC;
+        tsc->header.version = TARTARUS_EXTENSION_TSC_VERSION;
+        tsc->header.size = sizeof(tartarus_extension_tsc_t);
+        tsc->frequency = g_x86_64_tsc_frequency;
+        tsc->flags = g_x86_64_tsc_invariant ? TARTARUS_TSC_FLAG_INVARIANT : 0;
+        switch(g_x86_64_tsc_source) {
+            case X86_64_TSC_SOURCE_CPUID:    tsc->source = TARTARUS_TSC_SOURCE_CPUID; break;
+            case X86_64_TSC_SOURCE_PM_TIMER: tsc->source = TARTARUS_TSC_SOURCE_PM_TIMER; break;
+            case X86_64_TSC_SOURCE_HPET:
+            case X86_64_TSC_SOURCE_NONE:     tsc->source = TARTARUS_TSC_SOURCE_HPET; break;
+        }
+        extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, tsc);
+    }
 
-        boot_info->cpu_count = 1;
-        boot_info->cpus = HHDM_CAST(tartarus_cpu_t *, bsp_cpu);
+    tartarus_extension_vector_state_t *vector_state = arena_take(&arena, sizeof(tartarus_extension_vector_state_t));
+    vector_state->header.id = TARTARUS_EXTENSION_VECTOR_STATE;
+    vector_state->header.version = TARTARUS_EXTENSION_VECTOR_STATE_VERSION;
+    vector_state->header.size = sizeof(tartarus_extension_vector_state_t);
+    vector_state->xcr0 = g_x86_64_cpu_xcr0;
+    vector_state->save_area_size = vector_save_area_size;
+    extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, vector_state);
+
+    tartarus_extension_numa_t *numa_extension = NULL;
+    if(numa != NULL) {
+        numa_extension = arena_take(&arena, sizeof(tartarus_extension_numa_t));
+        numa_extension->header.id = TARTARUS_EXTENSION_NUMA;
+        numa_extension->header.version = TARTARUS_EXTENSION_NUMA_VERSION;
+        numa_extension->header.size = sizeof(tartarus_extension_numa_t);
+
+        uint32_t *cpu_domains = arena_take(&arena, sizeof(uint32_t) * cpu_count);
+        if(cpus != NULL) {
+            smp_cpu_t *cpu = cpus;
+            for(size_t i = 0; i < cpu_count; i++, cpu = cpu->next) cpu_domains[i] = cpu->domain;
+        } else {
+            cpu_domains[0] = numa_cpu_domain(numa, x86_64_lapic_id());
+        }
+        numa_extension->cpu_domains = HHDM_CAST(uint32_t *, cpu_domains);
+
+        tartarus_numa_memory_range_t *memory_ranges = arena_take(&arena, sizeof(tartarus_numa_memory_range_t) * numa->memory_range_count);
+        for(size_t i = 0; i < numa->memory_range_count; i++) {
+            memory_ranges[i].base = numa->memory_ranges[i].base;
+            memory_ranges[i].length = numa->memory_ranges[i].length;
+            memory_ranges[i].domain = numa->memory_ranges[i].domain;
+            memory_ranges[i].rsv0 = 0;
+        }
+        numa_extension->memory_range_count = numa->memory_range_count;
+        numa_extension->memory_ranges = HHDM_CAST(tartarus_numa_memory_range_t *, memory_ranges);
+
+        // The SLIT is copied, ACPI tables may be reclaimed by the kernel
+        uint8_t *distances = arena_take(&arena, numa->locality_count * numa->locality_count);
+        memcpy(distances, numa->distances, numa->locality_count * numa->locality_count);
+        numa_extension->locality_count = numa->locality_count;
+        numa_extension->distances = HHDM_CAST(uint8_t *, distances);
+
+        extensions[extension_index++] = HHDM_CAST(tartarus_extension_t *, numa_extension);
     }
 
+    boot_info->extension_count = extension_count;
+    boot_info->extensions = HHDM_CAST(__TARTARUS_PTR(tartarus_extension_t *) *, extensions);
+
+    uint64_t kernel_entry = kernel->entry;
+
+    // Nothing allocated as scratch is referenced past this point, hand it back as usable memory.
+    // Nothing was allocated through the caches since they were flushed, so releasing only merges map entries and the
+    // memory map still fits the space reserved for it.
+    heap_release_scratch();
+
     // Create the elysium memory map
-    tartarus_mm_entry_t *memory_map_entries = heap_alloc(sizeof(tartarus_mm_entry_t) * g_pmm_map_size);
+    if(g_pmm_map_size > mm_capacity) panic("memory map outgrew the boot info arena");
+    tartarus_mm_entry_t *memory_map_entries = arena_take(&arena, sizeof(tartarus_mm_entry_t) * g_pmm_map_size);
     for(uint64_t i = 0; i < g_pmm_map_size; i++) {
         tartarus_mm_type_t type;
         switch(g_pmm_map[i].type) {
             case PMM_MAP_TYPE_FREE:             type = TARTARUS_MM_TYPE_USABLE; break;
-            case PMM_MAP_TYPE_ALLOCATED:        type = TARTARUS_MM_TYPE_BOOTLOADER_RECLAIMABLE; break;
+            case PMM_MAP_TYPE_ALLOCATED:
+            case PMM_MAP_TYPE_SCRATCH:          type = TARTARUS_MM_TYPE_BOOTLOADER_RECLAIMABLE; break;
+            case PMM_MAP_TYPE_BOOT_INFO:        type = TARTARUS_MM_TYPE_BOOT_INFO; break;
             case PMM_MAP_TYPE_EFI_RECLAIMABLE:  type = TARTARUS_MM_TYPE_EFI_RECLAIMABLE; break;
             case PMM_MAP_TYPE_ACPI_RECLAIMABLE: type = TARTARUS_MM_TYPE_ACPI_RECLAIMABLE; break;
             case PMM_MAP_TYPE_ACPI_NVS:         type = TARTARUS_MM_TYPE_ACPI_NVS; break;
@@ -253,19 +734,68 @@
         memory_map_entries[i].length = g_pmm_map[i].length;
     }
 
+    if(numa_extension != NULL) {
+        uint32_t *mm_entry_domains = arena_take(&arena, sizeof(uint32_t) * g_pmm_map_size);
+        for(size_t i = 0; i < g_pmm_map_size; i++) mm_entry_domains[i] = numa_address_domain(numa, g_pmm_map[i].base);
+        numa_extension->mm_entry_domains = HHDM_CAST(uint32_t *, mm_entry_domains);
+    }
+
+    // Fill the page bitmap from the final memory map, split into parts across the parked APs
+    if(bitmap != NULL) {
+        uint64_t aligned_page_count = MATH_CEIL(bitmap_page_count, BITMAP_PART_ALIGNMENT);
+        uint64_t part_size = MATH_CEIL(MATH_DIV_CEIL(aligned_page_count, bitmap_worker_count), BITMAP_PART_ALIGNMENT);
+        for(size_t i = 0; i < bitmap_worker_count; i++) {
+            // APs already run on the kernel address space and reach the bitmap through the HHDM
+            uint64_t offset = i != 0 ? g_hhdm_offset : 0;
+
+            smp_bitmap_job_t *job = &bitmap_jobs[i];
+            job->bitmap = (uintptr_t) bitmap + offset;
+            job->page_start = i * part_size < aligned_page_count ? i * part_size : aligned_page_count;
+            job->page_end = job->page_start + part_size < aligned_page_count ? job->page_start + part_size : aligned_page_count;
+            job->entries = (uintptr_t) memory_map_entries + offset;
+            job->entry_count = g_pmm_map_size;
+            if(i != 0) smp_ap_bitmap_fill(bitmap_worker_parks[i], job, g_hhdm_offset);
+        }
+
+        bitmap_fill(&bitmap_jobs[0]);
+        for(size_t i = 1; i < bitmap_worker_count; i++) {
+            while(((volatile smp_bitmap_job_t *) &bitmap_jobs[i])->done == 0) __builtin_ia32_pause();
+        }
+        log(LOG_LEVEL_INFO, "Page bitmap built over %#llx pages (%lu workers)", bitmap_page_count, bitmap_worker_count);
+    }
+
     // Fill in the final fields before handoff
     boot_info->mm_entry_count = g_pmm_map_size;
     boot_info->mm_entries = HHDM_CAST(tartarus_mm_entry_t *, memory_map_entries);
+    boot_info->arena_paddr = arena.base;
+    boot_info->arena_size = arena.size;
     boot_info->boot_timestamp = arch_time();
 
+    timeline_mark(TIMELINE_STAGE_HANDOFF);
+    timeline->entry_count = 0;
+    for(size_t i = 0; i < TIMELINE_STAGE_COUNT; i++) {
+        if(g_timeline[i] == 0) continue;
+        timeline->entries[timeline->entry_count].stage = timeline_stage(i);
+        timeline->entries[timeline->entry_count].rsv0 = 0;
+        timeline->entries[timeline->entry_count].timestamp = g_timeline[i];
+        timeline->entry_count++;
+    }
+    timeline->header.size = sizeof(tartarus_extension_timeline_t) + sizeof(tartarus_timeline_entry_t) * timeline->entry_count;
+
+#ifdef __BUILD_DEBUG
+    timeline_log();
+    heap_stats_log();
+#endif
+
     // Handoff
     log(LOG_LEVEL_INFO, "Kernel handoff");
     x86_64_protocol_tartarus_handoff(
-        kernel->entry,
+        kernel_entry,
         HHDM_CAST(void *, stack),
         (uintptr_t) address_space->top_page_table,
         HHDM_CAST(uint64_t, boot_info),
-        ((uint16_t) MAJOR_VERSION << 8) | MINOR_VERSION
+        ((uint16_t) MAJOR_VERSION << 8) | MINOR_VERSION,
+        la57
     );
     __builtin_unreachable();
 }
@@ -1,5 +1,5 @@
 // Tartarus Bootloader API
-// Protocol Version 2.0
+// Protocol Version 3.0
 
 #ifndef __TARTARUS_BOOTLOADER_HEADER
 #define __TARTARUS_BOOTLOADER_HEADER
@@ -26,6 +26,35 @@
 
 #define TARTARUS_CPU_FLAG_IS_BSP (1 << 0)
 #define TARTARUS_CPU_FLAG_BOOT_OK (1 << 1)
+/// The local APIC was left in x2APIC mode, APIC IDs above 254 require it
+#define TARTARUS_CPU_FLAG_X2APIC (1 << 2)
+
+#define TARTARUS_EXTENSION_TIMELINE 0
+#define TARTARUS_EXTENSION_TIMELINE_VERSION 1
+
+#define TARTARUS_EXTENSION_PAGE_BITMAP 1
+#define TARTARUS_EXTENSION_PAGE_BITMAP_VERSION 1
+
+#define TARTARUS_EXTENSION_PAT 2
+#define TARTARUS_EXTENSION_PAT_VERSION 1
+
+#define TARTARUS_EXTENSION_NUMA 3
+#define TARTARUS_EXTENSION_NUMA_VERSION 1
+
+#define TARTARUS_NUMA_DOMAIN_NONE 0xFFFFFFFF
+
+#define TARTARUS_EXTENSION_TOPOLOGY 4
+#define TARTARUS_EXTENSION_TOPOLOGY_VERSION 1
+
+#define TARTARUS_TOPOLOGY_MAX_CACHES 8
+
+#define TARTARUS_EXTENSION_TSC 5
+#define TARTARUS_EXTENSION_TSC_VERSION 1
+
+#define TARTARUS_TSC_FLAG_INVARIANT (1 << 0)
+
+#define TARTARUS_EXTENSION_VECTOR_STATE 6
+#define TARTARUS_EXTENSION_VECTOR_STATE_VERSION 1
 
 typedef uint64_t tartarus_paddr_t;
 typedef uint64_t tartarus_vaddr_t;
@@ -52,7 +81,10 @@ typedef enum : uint64_t {
     TARTARUS_MM_TYPE_RESERVED,
 
     /// Memory marked as bad by firmware
-    TARTARUS_MM_TYPE_BAD
+    TARTARUS_MM_TYPE_BAD,
+
+    /// Boot information arena, usable once the kernel is done with the boot information
+    TARTARUS_MM_TYPE_BOOT_INFO
 } tartarus_mm_type_t;
 
 /// Physical memory map entry
@@ -65,10 +97,22 @@ typedef struct [[gnu::packed]] {
 /// Describes a CPU
 typedef struct [[gnu::packed]] {
     uint64_t flags;
+    /// Full 32-bit APIC ID, from either a LAPIC or an x2APIC MADT record
+    uint32_t lapic_id;
+    /// Mailbox of a parked CPU, on its own cache line. Write `argument` then `park_address`, the write wakes the CPU
     __TARTARUS_PTR(tartarus_vaddr_t *) park_address;
     __TARTARUS_PTR(uint64_t *) argument;
 } tartarus_cpu_t;
 
+/// Shared by every parked CPU, on its own cache line
+typedef struct [[gnu::packed]] {
+    /// Starts every parked CPU at once, write `broadcast_argument` first. CPUs with their own mailbox written take that instead.
+    /// Parked CPUs may wait with monitor/mwait on their own mailbox, send them any fixed IPI after the write to release them.
+    /// They wait with interrupts disabled so the IPI stays pending until the kernel enables them
+    tartarus_vaddr_t broadcast_address;
+    uint64_t broadcast_argument;
+} tartarus_park_control_t;
+
 /// Module loaded by Tartarus
 typedef struct [[gnu::packed]] {
     __TARTARUS_PTR(char *) name;
@@ -98,7 +142,7 @@ typedef struct [[gnu::packed]] {
     } mask;
 } tartarus_framebuffer_t;
 
-/// Describes a loaded segment of the kernel
+/// Describes a loaded segment of the kernel, segments are not necessarily physically contiguous
 typedef struct [[gnu::packed]] {
     tartarus_vaddr_t vaddr;
     tartarus_paddr_t paddr;
@@ -106,6 +150,180 @@ typedef struct [[gnu::packed]] {
     uint8_t flags;
 } tartarus_kernel_segment_t;
 
+/// Common header of every boot information extension
+typedef struct [[gnu::packed]] {
+    uint32_t id;
+    uint32_t version;
+    tartarus_size_t size;
+} tartarus_extension_t;
+
+/// Stage of the boot process recorded in the timeline
+typedef enum : uint32_t {
+    /// Firmware transferred control to Tartarus
+    TARTARUS_TIMELINE_STAGE_FIRMWARE_ENTRY,
+
+    /// Physical memory map was loaded
+    TARTARUS_TIMELINE_STAGE_MEMORY_MAP,
+
+    /// Disks were initialized
+    TARTARUS_TIMELINE_STAGE_DISKS,
+
+    /// Config was located and parsed
+    TARTARUS_TIMELINE_STAGE_CONFIG,
+
+    /// Framebuffer was acquired
+    TARTARUS_TIMELINE_STAGE_FRAMEBUFFER,
+
+    /// Kernel was loaded
+    TARTARUS_TIMELINE_STAGE_KERNEL,
+
+    /// Modules were loaded
+    TARTARUS_TIMELINE_STAGE_MODULES,
+
+    /// UEFI boot services were exited
+    TARTARUS_TIMELINE_STAGE_BOOTSERVICES_EXIT,
+
+    /// Application processors were initialized
+    TARTARUS_TIMELINE_STAGE_SMP,
+
+    /// Control is about to be transferred to the kernel
+    TARTARUS_TIMELINE_STAGE_HANDOFF
+} tartarus_timeline_stage_t;
+
+/// Timeline entry
+typedef struct [[gnu::packed]] {
+    tartarus_timeline_stage_t stage;
+    uint32_t rsv0;
+    uint64_t timestamp;
+} tartarus_timeline_entry_t;
+
+/// Timestamps of the boot stages reached, in order. On x86_64 timestamps are TSC values
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    tartarus_size_t entry_count;
+    tartarus_timeline_entry_t entries[];
+} tartarus_extension_timeline_t;
+
+/// Bitmap of usable pages. Page N is usable when bit N % 8 of byte N / 8 is set.
+/// The bitmap itself lives in boot info memory and covers pages up to `page_count`, every usable memory map entry lies below it
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    tartarus_size_t page_size;
+    tartarus_size_t page_count;
+    tartarus_paddr_t bitmap_paddr;
+    tartarus_size_t bitmap_size;
+    __TARTARUS_PTR(uint8_t *) bitmap;
+} tartarus_extension_page_bitmap_t;
+
+/// Page attribute table programmed on every CPU. The framebuffer is mapped with PWT set, selecting the
+/// write-combining entry. The kernel should keep this layout as long as it uses the mappings made by Tartarus
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    uint64_t pat;
+} tartarus_extension_pat_t;
+
+/// Memory range of a proximity domain, from the SRAT
+typedef struct [[gnu::packed]] {
+    tartarus_paddr_t base;
+    tartarus_size_t length;
+    uint32_t domain;
+    uint32_t rsv0;
+} tartarus_numa_memory_range_t;
+
+/// NUMA topology from the ACPI SRAT and SLIT. Domains are ACPI proximity domains, or `TARTARUS_NUMA_DOMAIN_NONE` when unknown.
+/// AP stacks and park mailboxes are allocated on the node of their CPU
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    /// Domain of each CPU, indexed like `cpus`
+    __TARTARUS_PTR(uint32_t *) cpu_domains;
+    /// Domain of each memory map entry, indexed like `mm_entries`. Taken from the base of the entry, entries can cross domains
+    __TARTARUS_PTR(uint32_t *) mm_entry_domains;
+    tartarus_size_t memory_range_count;
+    __TARTARUS_PTR(tartarus_numa_memory_range_t *) memory_ranges;
+    /// Relative distances from the SLIT, locality i to j is at `i * locality_count + j`. Zero localities without a SLIT
+    tartarus_size_t locality_count;
+    __TARTARUS_PTR(uint8_t *) distances;
+} tartarus_extension_numa_t;
+
+/// Type of a cache
+typedef enum : uint8_t {
+    TARTARUS_CACHE_TYPE_DATA = 1,
+    TARTARUS_CACHE_TYPE_INSTRUCTION = 2,
+    TARTARUS_CACHE_TYPE_UNIFIED = 3
+} tartarus_cache_type_t;
+
+/// Cache of a CPU, from CPUID leaf 4 (0x8000001D on AMD)
+typedef struct [[gnu::packed]] {
+    uint8_t level;
+    tartarus_cache_type_t type;
+    uint16_t line_size;
+    uint16_t ways;
+    uint16_t rsv0;
+    uint32_t sets;
+    /// CPUs with equal APIC IDs after shifting right by this share the cache
+    uint32_t sharing_shift;
+    /// APIC ID shifted right by `sharing_shift`, identifies the instance of the cache
+    uint32_t id;
+    uint32_t rsv1;
+    tartarus_size_t size;
+} tartarus_cache_t;
+
+/// Topology of a CPU, from CPUID leaf 0x1F or 0xB (leaves 1 and 4 on older CPUs)
+typedef struct [[gnu::packed]] {
+    /// Full APIC ID the topology is derived from
+    uint32_t apic_id;
+    uint32_t package_id;
+    /// Core within the package
+    uint32_t core_id;
+    /// Thread within the core
+    uint32_t smt_id;
+    /// APIC ID bits below the core level
+    uint8_t smt_shift;
+    /// APIC ID bits below the package level
+    uint8_t package_shift;
+    uint8_t cache_count;
+    uint8_t rsv0;
+    uint32_t rsv1;
+    tartarus_cache_t caches[TARTARUS_TOPOLOGY_MAX_CACHES];
+} tartarus_cpu_topology_t;
+
+/// Topology and caches of every CPU, recorded by each CPU during startup. Indexed like `cpus`, CPUs that failed to boot are zeroed
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    tartarus_size_t cpu_count;
+    tartarus_cpu_topology_t cpus[];
+} tartarus_extension_topology_t;
+
+/// Where the TSC frequency was taken from
+typedef enum : uint32_t {
+    /// CPUID leaf 0x15, or the base frequency from leaf 0x16
+    TARTARUS_TSC_SOURCE_CPUID = 1,
+    /// Calibrated against the ACPI PM timer
+    TARTARUS_TSC_SOURCE_PM_TIMER = 2,
+    /// Calibrated against the HPET
+    TARTARUS_TSC_SOURCE_HPET = 3
+} tartarus_tsc_source_t;
+
+/// TSC frequency, only present when it could be determined. Timeline timestamps can be converted with it
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    /// Frequency in Hz
+    uint64_t frequency;
+    uint32_t flags;
+    tartarus_tsc_source_t source;
+} tartarus_extension_tsc_t;
+
+/// FPU and vector state enabled identically on every CPU. x87 and SSE are always enabled (CR0.EM clear, CR0.MP/NE and
+/// CR4.OSFXSR/OSXMMEXCPT set, MXCSR at its default). With XSAVE, CR4.OSXSAVE is set and XCR0 holds `xcr0`
+typedef struct [[gnu::packed]] {
+    tartarus_extension_t header;
+    /// Zero without XSAVE
+    uint64_t xcr0;
+    /// Size of a save area for the enabled state, XSAVE when `xcr0` is set and FXSAVE otherwise
+    uint32_t save_area_size;
+    uint32_t rsv0;
+} tartarus_extension_vector_state_t;
+
 /// Main boot information
 typedef struct [[gnu::packed]] {
     uint64_t boot_timestamp;
@@ -114,6 +332,7 @@ typedef struct [[gnu::packed]] {
     tartarus_size_t bsp_entry_stack_size;
     tartarus_size_t ap_entry_stack_size;
 
+    /// Depends on the paging mode, 5-level paging (CR4.LA57) uses a lower offset to fit a larger HHDM
     tartarus_vaddr_t hhdm_offset;
     tartarus_size_t hhdm_size;
 
@@ -131,6 +350,15 @@ typedef struct [[gnu::packed]] {
 
     tartarus_size_t cpu_count;
     __TARTARUS_PTR(tartarus_cpu_t *) cpus;
+    /// Null when no CPUs are parked
+    __TARTARUS_PTR(tartarus_park_control_t *) park_control;
+
+    tartarus_size_t extension_count;
+    __TARTARUS_PTR(__TARTARUS_PTR(tartarus_extension_t *) *) extensions;
+
+    /// Page aligned region holding this structure and everything it references
+    tartarus_paddr_t arena_paddr;
+    tartarus_size_t arena_size;
 } tartarus_boot_info_t;
 
 #endif